@@ -0,0 +1,35 @@
+#!/bin/sh
+# Builds optimized and runs the performance regression check.
+#
+#   ./bench.sh                    compare against tests/perf_baseline.json
+#   ./bench.sh --update-baseline  record this machine's numbers as the baseline
+#   ./bench.sh --micro            also run the json_bench micro-benchmarks
+#
+# BUILD_DIR (default build-bench) picks the build directory,
+# JSON_EVAL_PERF_TOLERANCE the allowed slowdown in percent (default 50).
+set -e
+cd "$(dirname "$0")"
+
+BUILD_DIR=${BUILD_DIR:-build-bench}
+UPDATE=""
+MICRO=""
+for arg in "$@"; do
+    case "$arg" in
+        --update-baseline) UPDATE="--update" ;;
+        --micro) MICRO=1 ;;
+        *) echo "Usage: $0 [--update-baseline] [--micro]" >&2; exit 2 ;;
+    esac
+done
+
+cmake -S . -B "$BUILD_DIR" -DCMAKE_BUILD_TYPE=Release
+TARGETS="perf_regression"
+if [ -n "$MICRO" ]; then
+    TARGETS="$TARGETS json_bench"
+fi
+cmake --build "$BUILD_DIR" -j"$(nproc)" --target $TARGETS
+
+if [ -n "$MICRO" ]; then
+    "$BUILD_DIR/bin/json_bench" --benchmark_out="$BUILD_DIR/json_bench.json" --benchmark_out_format=json
+fi
+"$BUILD_DIR/bin/perf_regression" --baseline tests/perf_baseline.json \
+    --tolerance "${JSON_EVAL_PERF_TOLERANCE:-50}" $UPDATE
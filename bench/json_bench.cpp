@@ -0,0 +1,192 @@
+#include <benchmark/benchmark.h>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include "parser.h"
+#include "expression.h"
+#include "pipelined_reader.h"
+
+// Micro-benchmarks for parsing, path lookup, expression evaluation and
+// printing. Run with --benchmark_out=<file> --benchmark_out_format=json to
+// keep the numbers of a run for comparison.
+
+namespace {
+
+std::string readFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open benchmark input " + path);
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+const std::string &corpusFile(const std::string &name) {
+    static std::map<std::string, std::string> files;
+    auto it = files.find(name);
+    if (it == files.end()) {
+        it = files.emplace(name, readFile(std::string(JSON_BENCH_DATA_DIR) + "/" + name)).first;
+    }
+    return it->second;
+}
+
+// {"records": [{"id": 0, "v": .., "name": ".."}, ...]}, same seed every run
+std::string generateRecords(int count) {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> value(0, 1000);
+    std::string json = "{\"records\": [";
+    for (int i = 0; i < count; ++i) {
+        json += (i ? ", " : "") + std::string("{\"id\": ") + std::to_string(i) + ", \"v\": " +
+                std::to_string(value(rng)) + ", \"name\": \"record" + std::to_string(i) + "\"}";
+    }
+    return json + "]}";
+}
+
+// `depth` levels of objects with `width` members each; the path returned
+// follows the last member at every level
+std::pair<std::string, std::string> generateNested(int depth, int width) {
+    std::string json = "1";
+    std::string path;
+    for (int level = depth - 1; level >= 0; --level) {
+        std::string object = "{";
+        for (int i = 0; i < width; ++i) {
+            object += (i ? ", " : "") + std::string("\"k") + std::to_string(i) + "\": " + (i == width - 1 ? json : "0");
+        }
+        json = object + "}";
+    }
+    for (int level = 0; level < depth; ++level) {
+        path += (level ? "." : "") + std::string("k") + std::to_string(width - 1);
+    }
+    return {json, path};
+}
+
+const std::string &corpus(int id) {
+    static const std::string generated = generateRecords(20000);
+    switch (id) {
+        case 0: return corpusFile("small.json");
+        case 1: return corpusFile("big.json");
+        default: return generated;
+    }
+}
+
+const char *corpusName(int id) {
+    return id == 0 ? "small.json" : id == 1 ? "big.json" : "records";
+}
+
+void CorpusArguments(benchmark::internal::Benchmark *b) {
+    b->ArgName("corpus")->Arg(0)->Arg(1)->Arg(2);
+}
+
+// Parse throughput per backend
+
+void BM_ParseString(benchmark::State &state) {
+    const std::string &json = corpus(state.range(0));
+    JsonParser parser;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parser.parse(json));
+    }
+    state.SetLabel(corpusName(state.range(0)));
+    state.SetBytesProcessed(state.iterations() * json.size());
+}
+BENCHMARK(BM_ParseString)->Apply(CorpusArguments)->Unit(benchmark::kMillisecond);
+
+void BM_ParseStream(benchmark::State &state) {
+    const std::string &json = corpus(state.range(0));
+    JsonParser parser;
+    for (auto _ : state) {
+        std::istringstream input(json);
+        benchmark::DoNotOptimize(parser.parse(input));
+    }
+    state.SetLabel(corpusName(state.range(0)));
+    state.SetBytesProcessed(state.iterations() * json.size());
+}
+BENCHMARK(BM_ParseStream)->Apply(CorpusArguments)->Unit(benchmark::kMillisecond);
+
+// File on disk through the read-ahead thread and the decompression layer,
+// as json_eval does it
+void BM_ParsePipelinedFile(benchmark::State &state) {
+    std::string path = std::string(JSON_BENCH_DATA_DIR) + "/" + corpusName(state.range(0));
+    std::size_t bytes = corpusFile(corpusName(state.range(0))).size();
+    for (auto _ : state) {
+        PipelinedFileReader reader(path);
+        std::istream input(&reader);
+        JsonStorage storage(input);
+        benchmark::DoNotOptimize(storage.root());
+    }
+    state.SetLabel(corpusName(state.range(0)));
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+BENCHMARK(BM_ParsePipelinedFile)->Arg(0)->Arg(1)->ArgName("corpus")->Unit(benchmark::kMillisecond);
+
+// Path lookup latency by depth and object width
+
+void BM_LookupByDepthAndWidth(benchmark::State &state) {
+    auto [json, path] = generateNested(state.range(0), state.range(1));
+    JsonStorage storage(json);
+    std::vector<Path> steps = JsonPathEvalator::compile(path);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(storage.select(steps));
+    }
+}
+BENCHMARK(BM_LookupByDepthAndWidth)->ArgNames({"depth", "width"})->ArgsProduct({{1, 4, 16, 64}, {1, 16, 256}});
+
+// Same lookups given as strings, with and without the path index
+void BM_LookupIndexed(benchmark::State &state) {
+    auto [json, path] = generateNested(state.range(0), 16);
+    JsonStorage storage(json);
+    if (state.range(1)) {
+        storage.build_index();
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(storage.select(path));
+    }
+}
+BENCHMARK(BM_LookupIndexed)->ArgNames({"depth", "indexed"})->ArgsProduct({{1, 16, 64}, {0, 1}});
+
+// Expression evaluation, compiled once
+
+void BM_Evaluate(benchmark::State &state, int corpusId, const char *expression) {
+    JsonStorage storage(corpus(corpusId));
+    ExpressionEvaluator evaluator(storage);
+    CompiledExpression compiled = evaluator.compile(expression);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(evaluator.evaluate(compiled));
+    }
+    state.SetLabel(expression);
+}
+BENCHMARK_CAPTURE(BM_Evaluate, small_size, 0, "size(events)");
+BENCHMARK_CAPTURE(BM_Evaluate, big_max_wildcard, 1, "max(events.*.id)");
+BENCHMARK_CAPTURE(BM_Evaluate, big_descendant, 1, "count(..id)");
+BENCHMARK_CAPTURE(BM_Evaluate, records_sum_column, 2, "sum(records[*].v)");
+BENCHMARK_CAPTURE(BM_Evaluate, records_filter, 2, "count(records[?(@.v > 500)])");
+
+void BM_Compile(benchmark::State &state) {
+    JsonStorage storage("{}");
+    ExpressionEvaluator evaluator(storage);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(evaluator.compile("max(a.b[?(@.c > 3 && @.d == \"x\")].e, size(f.g[1:5]), 7)"));
+    }
+}
+BENCHMARK(BM_Compile);
+
+// Serialization throughput, measured on the printed size
+
+void BM_Print(benchmark::State &state) {
+    JsonParser parser;
+    JsonValue value = parser.parse(corpus(state.range(0)));
+    std::ostringstream sizing;
+    printJsonValue(value, sizing);
+    for (auto _ : state) {
+        std::ostringstream out;
+        printJsonValue(value, out);
+        benchmark::DoNotOptimize(out.tellp());
+    }
+    state.SetLabel(corpusName(state.range(0)));
+    state.SetBytesProcessed(state.iterations() * sizing.str().size());
+}
+BENCHMARK(BM_Print)->Apply(CorpusArguments)->Unit(benchmark::kMillisecond);
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstddef>
+#include <limits>
+
+// Vectorized reduction kernels used by the aggregate functions
+// (sum, avg, count, min, max) of the expression evaluator.
+
+struct IntAggregate {
+    long long sum = 0;
+    int min = std::numeric_limits<int>::max();
+    int max = std::numeric_limits<int>::min();
+    std::size_t count = 0;
+
+    void merge(const IntAggregate &other);
+};
+
+// Reduces a contiguous run of ints. Uses AVX2 when the CPU supports it and a
+// multi-accumulator loop the compiler can vectorize otherwise.
+IntAggregate aggregateInts(const int *values, std::size_t count);
+
+// Collects ints one at a time into a fixed block and reduces every full block
+// with aggregateInts, so values scattered over JsonValue nodes still go
+// through the vectorized kernel.
+class IntBlockReducer {
+public:
+    void push(int value) {
+        block[pending++] = value;
+        if (pending == BlockSize) {
+            flush();
+        }
+    }
+
+    // Merges an already reduced run, e.g. a whole projected column
+    void add(const IntAggregate &aggregate) {
+        total.merge(aggregate);
+    }
+
+    IntAggregate finish() {
+        flush();
+        return total;
+    }
+
+private:
+    static constexpr std::size_t BlockSize = 512;
+
+    int block[BlockSize];
+    std::size_t pending = 0;
+    IntAggregate total;
+
+    void flush();
+};
@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "aggregate.h"
+
+// One field projected across an array of objects (records[*].latency) into
+// contiguous storage, so aggregates scan a flat int buffer instead of
+// chasing one std::map node per record. Only fields that are ints wherever
+// present are projected, so a column stands in for the nodes the path matches.
+struct IntColumn {
+    std::vector<int> values;              // One slot per row, 0 for rows without the field
+    std::vector<std::uint64_t> validity;  // Bit i is set when row i has the field
+    std::size_t rows = 0;
+    std::size_t valid_count = 0;          // Rows having the field
+
+    bool is_valid(std::size_t row) const { return (validity[row / 64] >> (row % 64)) & 1; }
+
+    void append(const int *value);  // nullptr appends a null row
+
+    // Reduces all valid rows. Fully valid 64-row words are fed to the kernel
+    // as contiguous runs, only words containing nulls are walked bit by bit.
+    IntAggregate aggregate() const;
+};
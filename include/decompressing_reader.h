@@ -0,0 +1,49 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <streambuf>
+#include <vector>
+
+// Stream buffer that decompresses gzip or zstd input on the fly, a block at a
+// time, so compressed files never have to be inflated to disk or memory as a
+// whole. The format is detected from the magic bytes at the start; anything
+// else is passed through unchanged. Formats the build has no library for
+// (see JSON_EVAL_HAVE_ZLIB / JSON_EVAL_HAVE_ZSTD) are rejected with an error.
+class DecompressingStreamBuf : public std::streambuf {
+public:
+    enum Format { Plain, Gzip, Zstd };
+
+    static constexpr std::size_t DefaultBufferSize = 256 << 10;
+
+    explicit DecompressingStreamBuf(std::streambuf &source, std::size_t bufferSize = DefaultBufferSize);
+    ~DecompressingStreamBuf() override;
+
+    Format format() const { return detected; }
+
+    // Decompressed bytes taken from this buffer so far
+    std::uint64_t bytes_read() const { return handedOut - (egptr() - gptr()); }
+
+    // Whether this build can decompress the given format
+    static bool supports(Format format);
+
+    // zlib or libzstd state, only known to the implementation
+    struct Decoder;
+
+protected:
+    int_type underflow() override;
+
+private:
+    std::streambuf &source;
+    Format detected = Plain;
+    std::vector<char> input;
+    std::size_t inputPos = 0;
+    std::size_t inputSize = 0;
+    bool sourceDone = false;
+    bool frameEnded = false;  // Decoder finished a gzip member / zstd frame
+    std::uint64_t handedOut = 0;
+    std::vector<char> output;
+    std::unique_ptr<Decoder> decoder;
+
+    bool refill();
+};
@@ -0,0 +1,36 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "parser.h"
+
+// Publishes immutable versions of a document to concurrent readers, RCU
+// style. Readers grab the current version with snapshot() and query it
+// through their own JsonStorage; a writer parses the next version on its own
+// time and swaps the pointer in atomically. A version is freed once the last reader
+// holding it lets go.
+class DocumentStore {
+public:
+    explicit DocumentStore(const std::string &jsonContent);
+    explicit DocumentStore(std::shared_ptr<const JsonValue> document);
+
+    struct Snapshot {
+        std::shared_ptr<const JsonValue> document;
+        std::uint64_t version;
+    };
+
+    // Readers never wait for a parse, which happens before publishing. The
+    // atomic shared_ptr is not lock-free in libstdc++, so a load briefly
+    // shares an internal lock with the pointer swap in publish().
+    Snapshot snapshot() const;
+
+    // Replace the published document, returns the new version number
+    std::uint64_t publish(std::shared_ptr<const JsonValue> document);
+    std::uint64_t reload(const std::string &jsonContent);
+
+private:
+    std::atomic<std::shared_ptr<const Snapshot>> current;
+    std::mutex writer;
+};
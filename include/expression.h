@@ -1,34 +1,193 @@
 #pragma once
 #include "parser.h"
+#include "aggregate.h"
+#include <chrono>
 #include <functional>
+#include <limits>
 #include <map>
 #include <regex>
+#include <string_view>
+
+// Result of evaluating a (sub)expression. Paths are kept as pointers into the
+// document, multi-valued paths (wildcards, slices, recursive descent) as the
+// list of matched nodes, so function arguments are never deep-copied.
+// Projectable int fields (records[*].latency) passed to an aggregate come as
+// a cached column instead.
+struct EvalResult {
+    JsonValue value;                      // Owned result of literals and function calls
+    const JsonValue *ref = nullptr;       // Single node matched by a plain path
+    NodeList nodes;                       // Nodes matched by a multi-valued path
+    const IntColumn *column = nullptr;    // Replaces nodes for projected paths
+    std::shared_ptr<const PackedElements> elements;  // See PathMatch::elements
+    bool multi_valued = false;
+
+    const JsonValue &single() const { return ref ? *ref : value; }
+    std::size_t match_count() const { return column ? column->valid_count : nodes.size(); }
+    JsonValue materialize() const;
+};
+
+// Functions are plain function pointers, called directly once resolved
+using FunctionImpl = JsonValue (*)(const std::vector<EvalResult> &args);
+
+// Set of JsonValue types, used for compile-time type checks
+using TypeMask = unsigned;
+constexpr TypeMask typeBit(JsonValue::Type type) { return 1u << type; }
+constexpr TypeMask AnyType = typeBit(JsonValue::INT) | typeBit(JsonValue::STRING) |
+                             typeBit(JsonValue::OBJECT) | typeBit(JsonValue::ARRAY);
+
+struct FunctionInfo {
+    static constexpr std::size_t Variadic = std::numeric_limits<std::size_t>::max();
+
+    std::string_view name;
+    std::size_t min_arity;
+    std::size_t max_arity;
+    FunctionImpl impl;
+    TypeMask arg_types = AnyType;     // Types each argument may have
+    TypeMask result_types = AnyType;  // Types the result may have
+    bool pure = false;                // Same arguments give the same result, allows folding
+    bool aggregate = false;           // Ranges over argument values, takes columns (see EvalResult)
+};
+
+// Expression tree produced by ExpressionEvaluator::compile. Function names are
+// resolved, arities and argument types checked and constant sub-expressions
+// folded while compiling; evaluation only follows the FunctionInfo pointer.
+// Compare, And, Or and Not only occur in filter predicates and yield 1 or 0.
+struct ExpressionNode {
+    enum Kind { Literal, PathRef, Call, Compare, And, Or, Not } kind = Literal;
+    enum CompareOp { Equal, NotEqual, Less, LessEqual, Greater, GreaterEqual };
+
+    JsonValue literal;                       // Literal
+    std::string path;                        // PathRef
+    std::vector<Path> steps;                 // PathRef, compiled path
+    bool relative = false;                   // PathRef, starts at `@` instead of the root
+    const FunctionInfo *function = nullptr;  // Call
+    CompareOp op = Equal;                    // Compare
+    std::vector<ExpressionNode> args;        // Call, Compare, And, Or, Not
+};
+
+class CompiledExpression {
+public:
+    explicit CompiledExpression(ExpressionNode root) : root(std::move(root)) {}
+
+    ExpressionNode root;
+};
+
+// Work done by an evaluator so far, see ExpressionEvaluator::stats()
+struct EvaluationStats {
+    std::uint64_t evaluations = 0;
+    std::chrono::microseconds compile_time{0};   // Expressions compiled by evaluate(string)
+    std::chrono::microseconds evaluate_time{0};
+    AllocationCounters allocations;              // Made while compiling and evaluating
+    CategoryAllocations allocations_by_category;  // See JSON_EVAL_TRACK_ALLOCATIONS
+};
 
 class ExpressionEvaluator {
 public:
     ExpressionEvaluator(JsonStorage &jsonStorage);
     JsonValue evaluate(const std::string &expression);
 
+    // Compile once, evaluate many times. A compiled expression may refer to
+    // functions registered on this evaluator, so it must not outlive it.
+    CompiledExpression compile(const std::string &expression) const;
+    JsonValue evaluate(const CompiledExpression &expression);
+
+    const EvaluationStats &stats() const { return evaluationStats; }
+
+    // Adds a user-defined function, dispatched exactly like the built-ins.
+    // Built-in names cannot be redefined. Calls to pure functions with
+    // constant arguments are evaluated once at compile time.
+    void registerFunction(const std::string &name, std::size_t minArity, std::size_t maxArity, FunctionImpl impl,
+                          TypeMask argTypes = AnyType, TypeMask resultTypes = AnyType, bool pure = false);
+
+    // Filter predicates, the `(...)` of `[?(...)]` starting at pos. Only
+    // built-in functions can be called, since paths are compiled without an
+    // evaluator. matchesFilter is safe to call from several threads at once.
+    static std::shared_ptr<const ExpressionNode> compileFilter(const std::string &expression, std::size_t &pos);
+    static bool matchesFilter(const ExpressionNode &predicate, const JsonValue &candidate, const JsonValue &root);
+
+    // Subscriptions: the callback gets the result right away and again after
+    // every patch that touches a location the expression depends on. Errors
+    // while re-evaluating are thrown from applyPatch/applyMergePatch, after
+    // the document has been updated.
+    using SubscriptionCallback = std::function<void(const JsonValue &result)>;
+    std::size_t subscribe(CompiledExpression expression, SubscriptionCallback callback);
+    void unsubscribe(std::size_t id);
+
+    // Patch the storage (see JsonStorage::apply_patch and merge_patch) and
+    // re-evaluate only the affected subscriptions
+    void applyPatch(const std::string &patch);
+    void applyMergePatch(const std::string &patch);
+
+    // Locations an expression reads. A path contributes its plain key/index
+    // prefix, up to its first wildcard, slice, descendant, dynamic or filter
+    // step; anything below that prefix may affect it.
+    static std::vector<JsonPointer> dependencies(const ExpressionNode &node);
+
 private:
+    struct Subscription {
+        CompiledExpression expression;
+        std::vector<JsonPointer> dependencies;
+        SubscriptionCallback callback;
+    };
+    using FunctionMap = std::map<std::string, FunctionInfo>;
+
+    // Where paths are looked up: the storage when there is one (so projected
+    // columns are used), otherwise root. `@` paths start at current.
+    struct EvalContext {
+        JsonStorage *storage;
+        const JsonValue *root;
+        const JsonValue *current;
+    };
+
     JsonStorage &storage;
+    EvaluationStats evaluationStats;
+
+    // Parsing functions. userFunctions is nullptr when compiling filters.
+    static ExpressionNode compileExpression(const std::string &expression, std::size_t &pos, const FunctionMap *userFunctions);
+    static ExpressionNode compileFunctionCall(const std::string &expression, std::size_t &pos, const FunctionMap *userFunctions);
+    static ExpressionNode compilePathOrLiteral(const std::string &expression, std::size_t &pos);
+    static ExpressionNode compilePath(const std::string &expression, std::size_t &pos);
+    static ExpressionNode compileOr(const std::string &expression, std::size_t &pos);
+    static ExpressionNode compileAnd(const std::string &expression, std::size_t &pos);
+    static ExpressionNode compileComparison(const std::string &expression, std::size_t &pos);
 
-    // Parsing and evaluation functions
-    JsonValue evaluateExpression(const std::string &expression, std::size_t &pos);
-    JsonValue parseFunctionCall(const std::string &expression, std::size_t &pos);
-    JsonValue parsePathOrLiteral(const std::string &expression, std::size_t &pos);
-    JsonValue parsePath(const std::string &expression, std::size_t &pos);
+    // Compile-time passes over a call node whose arguments are already compiled
+    static TypeMask staticType(const ExpressionNode &node);
+    static void checkArgumentTypes(const ExpressionNode &node);
+    static void foldConstants(ExpressionNode &node);
+
+    // Evaluation functions
+    static EvalResult evaluateNode(const ExpressionNode &node, const EvalContext &context);
+    static EvalResult evaluatePath(const ExpressionNode &node, const EvalContext &context, bool aggregateArgument = false);
+    static bool evaluateComparison(const ExpressionNode &node, const EvalContext &context);
+    static bool isTruthy(const EvalResult &result);
 
     // Function evaluators
-    JsonValue evaluateMinFunction(const std::vector<JsonValue> &args);
-    JsonValue evaluateMaxFunction(const std::vector<JsonValue> &args);
-    JsonValue evaluateSizeFunction(const std::vector<JsonValue> &args);
+    static JsonValue evaluateMinFunction(const std::vector<EvalResult> &args);
+    static JsonValue evaluateMaxFunction(const std::vector<EvalResult> &args);
+    static JsonValue evaluateSizeFunction(const std::vector<EvalResult> &args);
+    static JsonValue evaluateSumFunction(const std::vector<EvalResult> &args);
+    static JsonValue evaluateAvgFunction(const std::vector<EvalResult> &args);
+    static JsonValue evaluateCountFunction(const std::vector<EvalResult> &args);
 
     // Utility functions
-    void skipWhitespace(const std::string &expression, std::size_t &pos);
-    JsonValue getSize(const JsonValue &value);
-    bool compareJsonValues(const JsonValue &lhs, const JsonValue &rhs);
+    static void skipWhitespace(const std::string &expression, std::size_t &pos);
+    static JsonValue getSize(const JsonValue &value);
+    static bool compareJsonValues(const JsonValue &lhs, const JsonValue &rhs);
+    static JsonValue reduceExtreme(const std::vector<EvalResult> &args, bool pickMax);
+    static IntAggregate reduceNumeric(const std::vector<EvalResult> &args, const std::string &functionName);
+    static int clampToInt(long long value);
+
+    // Function lookup: built-ins live in a constexpr perfect-hash table,
+    // user-defined functions in userFunctions. Both are only consulted by compile.
+    static const FunctionInfo *findBuiltin(std::string_view name);
+    static const FunctionInfo *findFunction(const std::string &name, const FunctionMap *userFunctions);
+    FunctionMap userFunctions;
+
+    std::map<std::size_t, Subscription> subscriptions;
+    std::size_t nextSubscription = 0;
 
-    // Map function names to evaluation functions
-    using FunctionEvaluator = std::function<JsonValue(const std::vector<JsonValue> &)>;
-    std::map<std::string, FunctionEvaluator> functionsMap;
+    static void collectDependencies(const ExpressionNode &node, bool inFilter, std::vector<JsonPointer> &out);
+    static void collectPathDependencies(const std::vector<Path> &steps, std::vector<JsonPointer> &out);
+    void notifySubscribers(const std::vector<JsonPointer> &touched);
 };
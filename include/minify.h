@@ -0,0 +1,12 @@
+#pragma once
+#include <cstddef>
+#include <string_view>
+
+// Whitespace stripper for JSON text that is copied out as it is, e.g. the
+// source spans json_eval --raw --minify writes.
+
+// Copies `text` to `out` without the whitespace between tokens; strings,
+// escapes included, are copied unchanged. `out` needs room for text.size()
+// bytes. Returns the number of bytes written. Uses AVX2 when the CPU
+// supports it and a byte-at-a-time loop otherwise.
+std::size_t minifyJson(std::string_view text, char *out);
@@ -4,111 +4,837 @@
 #include <sstream>
 #include <string>
 #include <map>
+#include <deque>
 #include <variant>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #include <stdexcept>
 #include <algorithm>
 #include <cctype>
+#include <optional>
+#include <memory>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <charconv>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include "column.h"
+#include "path_index.h"
+#include "stats.h"
 
 struct JsonValue;
-using JsonObject = std::map<std::string, JsonValue>;
+struct ObjectBlock;
+struct ArrayBlock;
+struct PackedInts;
+struct ShapedObject;
+struct IntKeyedObject;
+using JsonObject = std::map<std::string, JsonValue, std::less<>>;
 using JsonArray = std::vector<JsonValue>;
 
-struct JsonValue {
-    enum Type { INT, STRING, OBJECT, ARRAY } type;
-    std::variant<int, std::string, JsonObject, JsonArray> value;
+// A key written as a plain non-negative integer ("205705993", but not "007"
+// or "-1") as that integer, so objects keyed by ids can be stored and
+// searched by number
+std::optional<std::uint64_t> numericKey(std::string_view key);
 
-    JsonValue() : type(INT), value(0) {}  // Default constructor
-    JsonValue(int v) : type(INT), value(v) {}
-    JsonValue(const std::string &v) : type(STRING), value(v) {}
-    JsonValue(const JsonObject &v) : type(OBJECT), value(v) {}
-    JsonValue(const JsonArray &v) : type(ARRAY), value(v) {}
+// Key layout shared by every object with the same keys, like the hidden
+// classes of JavaScript engines. Keys are sorted, so slot order is the order
+// a JsonObject iterates in.
+class Shape {
+public:
+    static constexpr std::uint32_t npos = UINT32_MAX;
+
+    explicit Shape(std::vector<std::string> sortedKeys);
+    Shape(const Shape &) = delete;
+    Shape &operator=(const Shape &) = delete;
+
+    const std::vector<std::string> &keys() const { return key_list; }
+    std::size_t size() const { return key_list.size(); }
+
+    // Slot of `key`, npos if the shape has no such key
+    std::uint32_t find(std::string_view key) const {
+        auto it = slots.find(key);
+        return it == slots.end() ? npos : it->second;
+    }
+
+private:
+    const std::vector<std::string> key_list;
+    std::unordered_map<std::string_view, std::uint32_t> slots;  // Views into key_list
+};
+
+// Reference count at the start of every object and array block. Copies of
+// a container share its block, see JsonValue.
+struct RefCounted {
+    std::atomic<std::uint32_t> references{1};
+
+    RefCounted() = default;
+    RefCounted(const RefCounted &) {}  // A copy is a new block
+};
+
+// Elements of an array that holds nothing but ints, 4 bytes apiece instead
+// of a 16-byte node each. Paths read the ints directly and only make nodes
+// for the elements they match (see PathMatch::elements); code that needs
+// all elements as nodes (patches, the path index) goes through asArray(),
+// which builds them once on first use.
+struct PackedInts : RefCounted {
+    std::vector<int> values;
+    mutable std::once_flag expand_once;
+    mutable std::unique_ptr<JsonArray> expanded;
+
+    explicit PackedInts(std::vector<int> v) : values(std::move(v)) {}
+};
+
+// A JSON value in 16 bytes: the type tag, then the payload. Ints and strings
+// of up to InlineCapacity bytes (most keys and short values) are stored in
+// the node itself, longer strings and containers behind a single pointer.
+// Arrays of ints the parser read may point to PackedInts instead of a
+// JsonArray; size(), operator[] and printing work the same on both.
+// Objects and arrays are reference counted: a copy bumps the count of the
+// block and the mutable accessors give a value its own copy of a block that
+// others still refer to before handing it out, so copies cost O(1) and never
+// see each other's changes. Objects the parser read are usually a
+// ShapedObject, or an IntKeyedObject when all keys are numbers; find(),
+// forEachMember() and memberCount() read every form, asObject() builds a
+// JsonObject from the other two.
+// `type` is public for reading; the payload is reached through the as*()
+// accessors, which throw when the value has another type.
+struct alignas(8) JsonValue {
+    enum Type : std::uint8_t { INT, STRING, OBJECT, ARRAY };
+    Type type;
+
+    // Stands in for the std::variant<int, std::string, JsonObject, JsonArray>
+    // JsonValue used to keep in `value`, so std::get<T>(v.value) and
+    // std::holds_alternative<T>(v.value) still compile (see below). It takes
+    // no space and sits at the start of the node; new code uses as*().
+    struct VariantView {
+        std::size_t index() const { return owner().type; }
+        const JsonValue &owner() const { return *reinterpret_cast<const JsonValue *>(this); }
+        JsonValue &owner() { return *reinterpret_cast<JsonValue *>(this); }
+    };
+    [[no_unique_address]] VariantView value;
+
+    static constexpr std::size_t InlineCapacity = 14;
+
+    JsonValue() : JsonValue(0) {}  // Default constructor
+    JsonValue(int v) : type(INT), inline_length(0) { store(v); }
+    JsonValue(std::string_view v);
+    JsonValue(const std::string &v) : JsonValue(std::string_view(v)) {}
+    JsonValue(const char *v) : JsonValue(std::string_view(v)) {}
+    JsonValue(const JsonObject &v);
+    JsonValue(JsonObject &&v);
+    JsonValue(const JsonArray &v);
+    JsonValue(JsonArray &&v);
+
+    JsonValue(const JsonValue &other);
+    // An array in packed form, see PackedInts
+    static JsonValue packedArray(std::vector<int> values);
+
+    // An object in shaped form, `values` in the slot order of `shape`
+    static JsonValue shapedObject(std::shared_ptr<const Shape> shape, std::vector<JsonValue> values);
+
+    // An object in int-keyed form, see IntKeyedObject
+    static JsonValue intKeyedObject(IntKeyedObject object);
+
+    // The block behind an object or array, nullptr for ints and strings.
+    // Values with the same block are copies of each other.
+    const void *block() const {
+        return type == OBJECT || type == ARRAY ? load<const RefCounted *>() : nullptr;
+    }
+
+    // True when other values share the block
+    bool isShared() const;
+
+    JsonValue(JsonValue &&other) noexcept : type(other.type), inline_length(other.inline_length) {
+        std::memcpy(payload, other.payload, sizeof(payload));
+        other.type = INT;
+        other.inline_length = 0;
+        other.store(0);
+    }
+    JsonValue &operator=(const JsonValue &other);
+    JsonValue &operator=(JsonValue &&other) noexcept;
+    ~JsonValue() { release(); }
 
     bool isObject() const { return type == OBJECT; }
     bool isArray() const { return type == ARRAY; }
 
+    // A parsed null. It is the int 0 to everything but isNull(), which merge
+    // patches use to tell a member to remove from one to set to 0, and
+    // printing, which writes it back as null.
+    static JsonValue null() {
+        JsonValue result;
+        result.inline_length = Null;
+        return result;
+    }
+    bool isNull() const { return type == INT && inline_length == Null; }
+
+    int asInt() const {
+        expect(INT);
+        return load<int>();
+    }
+
+    // Views into the node or its heap block, valid while the value is
+    std::string_view asString() const {
+        expect(STRING);
+        if (inline_length != LongString) {
+            return std::string_view(payload, inline_length);
+        }
+        return std::string_view(load<const char *>(), load<std::uint32_t>(LengthOffset));
+    }
+
+    // For a shaped or int-keyed object the const version builds a JsonObject
+    // copy of the members once, so readers should prefer find() and
+    // forEachMember()
+    const JsonObject &asObject() const;
+
+    // Mutable access turns the other forms into a JsonObject of this value's
+    // own, see detach()
+    JsonObject &asObject();
+
+    // The shaped form of an object, nullptr for any other value
+    const ShapedObject *shaped() const;
+
+    // The int-keyed form of an object, nullptr for any other value
+    const IntKeyedObject *intKeyed() const;
+
+    // Member `key` of an object, nullptr if there is none or this is no object
+    const JsonValue *find(std::string_view key) const;
+
+    // Calls visit(std::string_view key, const JsonValue &member) for every
+    // member of an object in key order. The key may only be valid for the
+    // duration of the call.
+    template <typename Visit>
+    void forEachMember(Visit &&visit) const;
+
+    std::size_t memberCount() const;
+
+    // A packed array is expanded into nodes on the first call, the const
+    // version keeps the packed ints around for the readers that want them
+    const JsonArray &asArray() const;
+    JsonArray &asArray();
+
+    // The ints of a packed array, nullptr for any other value
+    const std::vector<int> *packedInts() const;
+
     bool contains(const std::string &key) const {
-        return isObject() && std::get<JsonObject>(value).count(key) > 0;
+        return find(key) != nullptr;
     }
 
     // Non-const versions
     JsonValue& operator[](const std::string &key) {
-        return std::get<JsonObject>(value)[key];
+        return asObject()[key];
     }
 
     JsonValue& operator[](std::size_t index) {
-        return std::get<JsonArray>(value)[index];
+        return asArray()[index];
     }
 
     // Const versions
     const JsonValue& operator[](const std::string &key) const {
-        return std::get<JsonObject>(value).at(key);
+        if (const JsonValue *member = find(key)) {
+            return *member;
+        }
+        throw std::out_of_range("No member " + key);
     }
 
+    // Expands a packed array, see asArray()
     const JsonValue& operator[](std::size_t index) const {
-        return std::get<JsonArray>(value).at(index);
+        return asArray().at(index);
     }
 
     std::size_t size() const {
-        return isArray() ? std::get<JsonArray>(value).size() : 0;
+        if (const std::vector<int> *ints = packedInts()) {
+            return ints->size();
+        }
+        return isArray() ? asArray().size() : 0;
+    }
+
+    // Deep comparison, used by filter predicates
+    bool operator==(const JsonValue &other) const;
+
+private:
+    static constexpr std::uint8_t LongString = 0xFF;  // inline_length of a heap string
+    static constexpr std::uint8_t Packed = 0xFE;      // inline_length of a packed array
+    static constexpr std::uint8_t Shaped = 0xFC;      // inline_length of a shaped object
+    static constexpr std::uint8_t IntKeyed = 0xFB;    // inline_length of an int-keyed object
+    static constexpr std::uint8_t Null = 0xFA;        // inline_length of a null
+    static constexpr std::size_t LengthOffset = 2;    // Heap string length, in payload
+    static constexpr std::size_t PointerOffset = 6;   // Int or pointer, at byte 8 of the node
+
+    std::uint8_t inline_length;  // Inline string length, or LongString
+    char payload[InlineCapacity];
+
+    // Fields inside payload are accessed through memcpy, which compiles to
+    // plain loads and stores but keeps the aliasing rules happy
+    template <typename T>
+    T load(std::size_t offset = PointerOffset) const {
+        T field;
+        std::memcpy(&field, payload + offset, sizeof(T));
+        return field;
+    }
+
+    template <typename T>
+    void store(T field, std::size_t offset = PointerOffset) {
+        std::memcpy(payload + offset, &field, sizeof(T));
+    }
+
+    // Containers keep a RefCounted pointer, cast to the block type its form has
+    template <typename Block>
+    Block *blockAs() const {
+        return static_cast<Block *>(load<RefCounted *>());
+    }
+
+    void expect(Type expected) const {
+        if (type != expected) {
+            throw std::runtime_error("JSON value has the wrong type");
+        }
+    }
+
+    void setString(std::string_view v);
+    const JsonArray &expanded() const;
+    const JsonObject &expandedObject() const;
+    void detach();
+    void copyFrom(const JsonValue &other);
+    void release();
+};
+static_assert(sizeof(JsonValue) == 16, "JsonValue is meant to be a 16-byte node");
+
+// Blocks of objects and arrays in plain form
+struct ObjectBlock : RefCounted {
+    JsonObject members;
+};
+
+struct ArrayBlock : RefCounted {
+    JsonArray elements;
+};
+
+// An object as its shape plus one value per slot. The parser stores objects
+// like this unless they have duplicate keys or more than MaxShapeKeys.
+struct ShapedObject : RefCounted {
+    std::shared_ptr<const Shape> shape;
+    std::vector<JsonValue> values;  // values[i] belongs to shape->keys()[i]
+    mutable std::once_flag expand_once;
+    mutable std::unique_ptr<JsonObject> expanded;  // See JsonValue::asObject()
+
+    ShapedObject(std::shared_ptr<const Shape> s, std::vector<JsonValue> v) : shape(std::move(s)), values(std::move(v)) {}
+};
+
+// An object whose keys are all numeric (see numericKey), stored as sorted
+// integer keys with the values alongside instead of one string per member
+struct IntKeyedObject : RefCounted {
+    std::vector<std::uint64_t> keys;  // Ascending
+    std::vector<JsonValue> values;    // values[i] belongs to keys[i]
+    // Positions in the order a JsonObject iterates in, i.e. by key string.
+    // Empty when that is the numeric order, as with keys of equal length.
+    std::vector<std::uint32_t> string_order;
+    mutable std::once_flag expand_once;
+    mutable std::unique_ptr<JsonObject> expanded;  // See JsonValue::asObject()
+
+    IntKeyedObject() = default;
+    IntKeyedObject(const IntKeyedObject &other)
+        : RefCounted(other), keys(other.keys), values(other.values), string_order(other.string_order) {}
+    IntKeyedObject(IntKeyedObject &&other) noexcept
+        : RefCounted(other), keys(std::move(other.keys)), values(std::move(other.values)),
+          string_order(std::move(other.string_order)) {}
+
+    const JsonValue *find(std::uint64_t key) const {
+        auto it = std::lower_bound(keys.begin(), keys.end(), key);
+        return it != keys.end() && *it == key ? &values[it - keys.begin()] : nullptr;
+    }
+
+    // Visits positions in key string order
+    template <typename Visit>
+    void forEachPosition(Visit &&visit) const {
+        if (string_order.empty()) {
+            for (std::size_t i = 0; i < keys.size(); ++i) {
+                visit(i);
+            }
+        } else {
+            for (std::uint32_t i : string_order) {
+                visit(i);
+            }
+        }
+    }
+};
+
+inline bool JsonValue::isShared() const {
+    return block() && load<const RefCounted *>()->references.load(std::memory_order_acquire) > 1;
+}
+
+inline const JsonObject &JsonValue::asObject() const {
+    expect(OBJECT);
+    if (inline_length == Shaped || inline_length == IntKeyed) {
+        return expandedObject();
+    }
+    return blockAs<const ObjectBlock>()->members;
+}
+
+inline JsonObject &JsonValue::asObject() {
+    expect(OBJECT);
+    detach();
+    return blockAs<ObjectBlock>()->members;
+}
+
+inline const ShapedObject *JsonValue::shaped() const {
+    return type == OBJECT && inline_length == Shaped ? blockAs<const ShapedObject>() : nullptr;
+}
+
+inline const IntKeyedObject *JsonValue::intKeyed() const {
+    return type == OBJECT && inline_length == IntKeyed ? blockAs<const IntKeyedObject>() : nullptr;
+}
+
+inline const JsonArray &JsonValue::asArray() const {
+    expect(ARRAY);
+    if (inline_length == Packed) {
+        return expanded();
+    }
+    return blockAs<const ArrayBlock>()->elements;
+}
+
+inline JsonArray &JsonValue::asArray() {
+    expect(ARRAY);
+    detach();
+    return blockAs<ArrayBlock>()->elements;
+}
+
+inline const std::vector<int> *JsonValue::packedInts() const {
+    return type == ARRAY && inline_length == Packed ? &blockAs<const PackedInts>()->values : nullptr;
+}
+
+inline const JsonValue *JsonValue::find(std::string_view key) const {
+    if (!isObject()) {
+        return nullptr;
+    }
+    if (const IntKeyedObject *object = intKeyed()) {
+        std::optional<std::uint64_t> number = numericKey(key);
+        return number ? object->find(*number) : nullptr;
+    }
+    if (const ShapedObject *object = shaped()) {
+        std::uint32_t slot = object->shape->find(key);
+        return slot == Shape::npos ? nullptr : &object->values[slot];
+    }
+    const JsonObject &obj = asObject();
+    auto it = obj.find(key);
+    return it == obj.end() ? nullptr : &it->second;
+}
+
+template <typename Visit>
+void JsonValue::forEachMember(Visit &&visit) const {
+    if (!isObject()) {
+        return;
+    }
+    if (const ShapedObject *object = shaped()) {
+        const std::vector<std::string> &keys = object->shape->keys();
+        for (std::size_t slot = 0; slot < keys.size(); ++slot) {
+            visit(std::string_view(keys[slot]), object->values[slot]);
+        }
+        return;
+    }
+    if (const IntKeyedObject *object = intKeyed()) {
+        char key[20];
+        object->forEachPosition([&](std::size_t i) {
+            char *end = std::to_chars(key, key + sizeof(key), object->keys[i]).ptr;
+            visit(std::string_view(key, end - key), object->values[i]);
+        });
+        return;
+    }
+    for (const auto &[key, member] : asObject()) {
+        visit(std::string_view(key), member);
+    }
+}
+
+inline std::size_t JsonValue::memberCount() const {
+    if (const ShapedObject *object = shaped()) {
+        return object->values.size();
+    }
+    if (const IntKeyedObject *object = intKeyed()) {
+        return object->values.size();
+    }
+    return isObject() ? asObject().size() : 0;
+}
+
+// std::get and std::holds_alternative on JsonValue::value, as they worked on
+// the variant: ints come by value, strings as a copy, objects and arrays by
+// reference, and the wrong type throws std::bad_variant_access.
+template <typename T>
+constexpr JsonValue::Type jsonAlternative() {
+    if constexpr (std::is_same_v<T, int>) {
+        return JsonValue::INT;
+    } else if constexpr (std::is_same_v<T, std::string>) {
+        return JsonValue::STRING;
+    } else if constexpr (std::is_same_v<T, JsonObject>) {
+        return JsonValue::OBJECT;
+    } else {
+        static_assert(std::is_same_v<T, JsonArray>, "JsonValue holds int, std::string, JsonObject or JsonArray");
+        return JsonValue::ARRAY;
+    }
+}
+
+namespace std {
+
+template <typename T>
+bool holds_alternative(const JsonValue::VariantView &view) {
+    return view.owner().type == jsonAlternative<T>();
+}
+
+template <typename T>
+conditional_t<is_same_v<T, int> || is_same_v<T, string>, T, const T &> get(const JsonValue::VariantView &view) {
+    const JsonValue &owner = view.owner();
+    if (owner.type != jsonAlternative<T>()) {
+        throw bad_variant_access();
+    }
+    if constexpr (is_same_v<T, int>) {
+        return owner.asInt();
+    } else if constexpr (is_same_v<T, string>) {
+        return string(owner.asString());
+    } else if constexpr (is_same_v<T, JsonObject>) {
+        return owner.asObject();
+    } else {
+        return owner.asArray();
     }
+}
+
+template <typename T>
+conditional_t<is_same_v<T, int> || is_same_v<T, string>, T, T &> get(JsonValue::VariantView &view) {
+    if constexpr (is_same_v<T, JsonObject>) {
+        get<T>(as_const(view));  // Type check
+        return view.owner().asObject();
+    } else if constexpr (is_same_v<T, JsonArray>) {
+        get<T>(as_const(view));
+        return view.owner().asArray();
+    } else {
+        return get<T>(as_const(view));
+    }
+}
+
+} // namespace std
+
+// Inline cache of an Object path step: the shape it last looked its key up
+// in and the slot it found there. Compiled paths may be shared between
+// threads, so the fields are atomics and a hit is checked against the key.
+struct ShapeCache {
+    std::atomic<const Shape *> shape{nullptr};
+    std::atomic<std::uint32_t> slot{0};
+
+    ShapeCache() = default;
+    ShapeCache(const ShapeCache &) {}  // A copy starts out empty
 };
+
+// Filter predicates are compiled and evaluated by the expression engine
+struct ExpressionNode;
+
 class Path
 {
 public:
-    enum Type { Terminal, Object, Array } type;
+    // Wildcard matches every element/member (`[*]`, `.*`), Slice a range of
+    // array elements (`[start:end:step]`) and Descendant the current node plus
+    // everything below it (the `..` in `..id`). Dynamic takes its index or key
+    // from another path (`a.b[a.b[1]]`), Filter keeps the elements a predicate
+    // holds for (`items[?(@.size > 100)]`).
+    enum Type { Terminal, Object, Array, Wildcard, Slice, Descendant, Dynamic, Filter } type;
 
     Path(Type t, const std::string &n, std::size_t index = 0)
-        : type(t), name(n), array_index(index) {}
+        : type(t), name(n), array_index(index), numeric_name(t == Object ? numericKey(n) : std::nullopt) {}
+
+    Path(std::optional<long> start, std::optional<long> end, long step)
+        : type(Slice), array_index(0), slice_start(start), slice_end(end), slice_step(step) {}
+
+    explicit Path(std::vector<Path> indexPath)
+        : type(Dynamic), array_index(0), index_path(std::move(indexPath)) {}
+
+    explicit Path(std::shared_ptr<const ExpressionNode> filter)
+        : type(Filter), array_index(0), predicate(std::move(filter)) {}
 
     // Data members
     const std::string name;           // Name of the path
     const std::size_t array_index;    // Index for array paths (default to 0)
+    const std::optional<std::uint64_t> numeric_name;  // name as a number, for int-keyed objects
+
+    // Slice bounds, negative values count from the end of the array
+    const std::optional<long> slice_start;
+    const std::optional<long> slice_end;
+    const long slice_step = 1;
+
+    // Path from the document root that yields the index or key of a Dynamic step
+    const std::vector<Path> index_path;
+
+    // Predicate of a Filter step, `@` refers to the element being tested
+    const std::shared_ptr<const ExpressionNode> predicate;
+
+    // Where an Object step found its key in the last shaped object it met
+    mutable ShapeCache shape_cache;
 
     // Functions to check the type
     bool is_terminal() const { return type == Terminal; }
     bool is_object() const { return type == Object; }
     bool is_array() const { return type == Array; }
+    bool is_wildcard() const { return type == Wildcard; }
+    bool is_slice() const { return type == Slice; }
+    bool is_descendant() const { return type == Descendant; }
+    bool is_dynamic() const { return type == Dynamic; }
+    bool is_filter() const { return type == Filter; }
+
+    // Steps that can match more than one node
+    bool is_multi_valued() const { return is_wildcard() || is_slice() || is_descendant() || is_filter(); }
+};
+
+// Nodes matched by a path. They point into the parsed document, so they stay
+// valid as long as the document does and are never copied.
+using NodeList = std::vector<const JsonValue*>;
+
+// Nodes made for the elements of packed arrays a path went through, which
+// have no node of their own in the document
+using PackedElements = std::deque<JsonValue>;
+
+struct PathMatch {
+    NodeList nodes;
+    bool multi_valued = false;  // Path contains wildcard, slice, descendant or filter steps
+    // Set when some of `nodes` point into it rather than into the document;
+    // holders of the nodes keep it alive along with them
+    std::shared_ptr<const PackedElements> elements;
 };
 
+// JSON Pointer (RFC 6901) split into unescaped reference tokens, "/a/b/0" is
+// {"a", "b", "0"} and the empty pointer refers to the whole document
+using JsonPointer = std::vector<std::string>;
+
+JsonPointer parseJsonPointer(const std::string &pointer);
+
+// True when one pointer is a prefix of the other, i.e. a change at one of
+// them can change the value at the other
+bool pointersOverlap(const JsonPointer &a, const JsonPointer &b);
+
+struct ParseOptions {
+    // Store identical objects and arrays once and share them between all the
+    // places they occur in, for documents that repeat the same blocks over
+    // and over. Queries see the same values; patches copy what they change.
+    bool deduplicate = false;
+
+    // Remember where each object and array starts and ends in the input and
+    // keep the input text, so results can be written out as the bytes they
+    // were read from, see JsonStorage::source_text()
+    bool record_spans = false;
+};
+
+// Bytes of the input an object or array was parsed from
+struct SourceSpan {
+    std::size_t offset = 0;
+    std::size_t length = 0;
+};
+
+// By JsonValue::block(), which copies of a value share
+using SourceSpans = std::unordered_map<const void *, SourceSpan>;
+
 // This converts strings to json values
 class JsonParser {
 public:
+    // Objects with more keys are stored as a JsonObject; they tend to be
+    // maps keyed by data rather than records, so a shape would not repeat
+    static constexpr std::size_t MaxShapeKeys = 32;
+
+    explicit JsonParser(ParseOptions options = {}) : options(options) {}
+
     JsonValue parse(const std::string &jsonContent);
 
+    // Parses straight from a stream, e.g. a PipelinedFileReader that is
+    // still reading the rest of the file
+    JsonValue parse(std::istream &input);
+
+    // Values parsed so far, indexed by JsonValue::Type
+    const std::array<std::uint64_t, 4> &node_counts() const { return nodes; }
+
+    // Objects and arrays parsed with deduplicate on, and how many of them
+    // were stored rather than shared with an identical earlier one
+    std::uint64_t subtrees_parsed() const { return subtrees; }
+    std::uint64_t subtrees_stored() const { return distinct_subtrees; }
+
+    // With record_spans, the text of the last parse and where its objects
+    // and arrays are in it. Recording reads ahead of the parser, so it may
+    // consume input after the end of the value.
+    std::string take_source() { return std::move(source); }
+    SourceSpans take_spans() { return std::move(spans); }
+
 private:
-    JsonValue parseValue(std::istringstream &ss);
-    std::string parseString(std::istringstream &ss);
-    int parseNumber(std::istringstream &ss);
-    JsonObject parseObject(std::istringstream &ss);
-    JsonArray parseArray(std::istringstream &ss);
+    ParseOptions options;
+    std::array<std::uint64_t, 4> nodes{};
+    int depth = 0;  // Containers currently open
+
+    // Members of the objects being parsed, innermost last
+    std::vector<std::pair<std::string, JsonValue>> members;
+
+    // Key orders met so far in this parse, by hash of the keys in order. A
+    // layout without a shape is one with duplicate keys.
+    struct ObjectLayout {
+        std::vector<std::string> keys;      // In document order
+        std::shared_ptr<const Shape> shape;
+        std::vector<std::uint32_t> slots;   // Slot of each key in shape
+    };
+    std::unordered_multimap<std::size_t, ObjectLayout> layouts;
+    std::map<std::vector<std::string>, std::shared_ptr<const Shape>> shapes;  // By sorted keys
+
+    // Subtrees stored so far in this parse, by hash
+    std::unordered_multimap<std::size_t, JsonValue> interned;
+    std::uint64_t subtrees = 0;
+    std::uint64_t distinct_subtrees = 0;
+
+    std::string source;
+    SourceSpans spans;
+
+    JsonValue intern(JsonValue value);
+    void clearParseState();
+    JsonValue parseValue(std::istream &ss);
+    std::string parseString(std::istream &ss);
+    int parseNumber(std::istream &ss);
+    JsonValue parseObject(std::istream &ss);
+    JsonValue buildObject(std::size_t first);
+    std::optional<JsonValue> buildIntKeyedObject(std::size_t first);
+    JsonValue parseArray(std::istream &ss);
 };
 
 class JsonPathEvalator {
 public:
     JsonPathEvalator(const JsonValue &json);
+    // The evaluator refers to the document, a temporary would be gone by the
+    // time it is evaluated
+    JsonPathEvalator(JsonValue &&json) = delete;
     JsonValue evaluate(const std::string &expression);
 
+    // Like evaluate, but hands back pointers to the matched nodes instead of
+    // copies. Multi-valued paths are walked lazily step by step, so e.g.
+    // items[*].price never builds an intermediate array of items.
+    PathMatch select(const std::string &expression);
+
+    // Parses a path into steps without looking anything up, so compiled paths
+    // can be selected repeatedly and against any document. `lenient` makes a
+    // plain path that does not exist an empty match instead of an error.
+    static std::vector<Path> compile(const std::string &expression);
+    PathMatch select(const std::vector<Path> &paths, bool lenient = false);
+
+    // Filter arrays at least this long are tested in parallel chunks
+    static constexpr std::size_t ParallelFilterThreshold = 8192;
+
+    // Projects `array[*].field` paths into an IntColumn. Returns nullptr for
+    // paths that are not is_projectable, when the prefix does not lead to an
+    // array or as soon as a row holds something other than an int there.
+    static bool is_projectable(const std::vector<Path> &paths);
+    std::unique_ptr<IntColumn> project(const std::vector<Path> &paths);
+
+    // Parses a quoted, escaped string literal starting at pos
+    static std::string parseStringInExpression(const std::string &expression, std::size_t &pos);
+
 private:
-    JsonValue jsonRoot;
+    const JsonValue &jsonRoot;
+    std::shared_ptr<PackedElements> elements;  // Of the match being selected
 
-    JsonValue evaluate(const std::string &expression, const JsonValue& context);
-    std::vector<Path> parse_expression_at(const std::string &expression, std::size_t &pos);
-    JsonValue parse_bracket_expression(const std::string &expression, std::size_t &pos);
-    std::string parseStringInExpression(const std::string &expression, std::size_t &pos);
+    // Element `index` of an array; for a packed array a node is made for it
+    const JsonValue &element(const JsonValue &array, std::size_t index);
+    const JsonValue& resolve(const std::vector<Path> &paths, const JsonValue& context);
+    const JsonValue* resolve_dynamic(const Path &path, const JsonValue &node, bool strict);
+    void collect(const std::vector<Path> &paths, std::size_t step, const JsonValue &node, NodeList &out);
+    void collect_filtered(const std::vector<Path> &paths, std::size_t step, const NodeList &candidates, NodeList &out);
+    static std::vector<Path> parse_expression_at(const std::string &expression, std::size_t &pos);
+    static Path parse_bracket_expression(const std::string &expression, std::size_t &pos);
+    static Path parse_slice(const std::string &expression, std::size_t &pos);
+};
+
+// What loading a document cost, see JsonStorage::stats(). Parse time
+// includes waiting for a stream that is still being read.
+struct ParseStats {
+    std::chrono::microseconds parse_time{0};
+    std::uint64_t input_bytes = 0;             // After decompression
+    std::array<std::uint64_t, 4> nodes{};      // Indexed by JsonValue::Type
+    AllocationCounters allocations;
+    CategoryAllocations allocations_by_category;  // See JSON_EVAL_TRACK_ALLOCATIONS
+    std::uint64_t subtrees = 0;                   // With ParseOptions::deduplicate
+    std::uint64_t distinct_subtrees = 0;
+
+    double megabytes_per_second() const { return megabytesPerSecond(input_bytes, parse_time); }
+
+    // Subtrees parsed per subtree stored, 1 without deduplication
+    double dedup_ratio() const {
+        return distinct_subtrees ? static_cast<double>(subtrees) / distinct_subtrees : 1.0;
+    }
 };
 
 // Interface for outside, it provides get which will provide the a path
 // so get(a.b[3]) -> JsonValue
 // It basically wraps parsed content + path evaluator for the expression parts
+//
+// A JsonStorage is meant to be used by one thread. For concurrent readers,
+// publish the document through a DocumentStore and give every thread its own
+// JsonStorage over the snapshot it takes; snapshots are immutable and shared.
 class JsonStorage
 {
 public:
-    JsonStorage(const std::string & jsonFileContent);
+    JsonStorage(const std::string & jsonFileContent, ParseOptions options = {});
+    // Reads the document from a stream, gzip and zstd input is detected and
+    // decompressed on the fly
+    explicit JsonStorage(std::istream & jsonInput, ParseOptions options = {});
+    explicit JsonStorage(std::shared_ptr<const JsonValue> document);
     JsonValue get(const std::string& path);
+    PathMatch select(const std::string& path);
+    PathMatch select(const std::vector<Path>& paths);
+    const JsonValue& root() const { return *json_content; }
+
+    // The current document. It never changes once handed out: patches
+    // applied while a snapshot is held work on a copy.
+    std::shared_ptr<const JsonValue> snapshot() const { return json_content; }
+
+    // Same as select(path), with `steps` the compiled form of `path`. Goes
+    // through the path index when there is one.
+    PathMatch select(const std::string& path, const std::vector<Path>& steps);
+
+    // Optional path index for documents that are queried over and over.
+    // build_index indexes the whole document up front (within the budget),
+    // enable_index starts empty and remembers each plain path on first use.
+    const PathIndex& build_index(std::size_t budgetBytes = PathIndex::DefaultBudget);
+    void enable_index(std::size_t budgetBytes = PathIndex::DefaultBudget);
+    const PathIndex* index() const { return path_index.get(); }
+
+    // In-place updates. apply_patch takes a JSON Patch (RFC 6902) array and
+    // either applies all of its operations or, if one fails, none of them.
+    // merge_patch takes an RFC 7396 merge patch. Both return the locations
+    // they changed and drop cached columns, path index entries and source
+    // spans, which describe the old document.
+    std::vector<JsonPointer> apply_patch(const std::string& patch);
+    std::vector<JsonPointer> merge_patch(const std::string& patch);
+
+    // Column of a projectable path, built on first use and kept until the
+    // document is patched; nullptr if the path cannot be projected. The
+    // second form takes the path already compiled.
+    const IntColumn* column(const std::string& path);
+    const IntColumn* column(const std::string& path, const std::vector<Path>& steps);
+
+    // Filled in by the parsing constructors, all zero otherwise
+    const ParseStats& stats() const { return parse_stats; }
+
+    // The input text `value` was parsed from if it is an object or array of
+    // this document, parsed with ParseOptions::record_spans and not patched
+    // since; empty otherwise. Copies of document values (evaluate results)
+    // share its blocks and find their text as well.
+    std::string_view source_text(const JsonValue& value) const;
 
 private:
-    JsonValue json_content;
+    std::shared_ptr<const JsonValue> json_content;
+    JsonValue* writable_content = nullptr;  // json_content if this storage created it
+    ParseStats parse_stats;
+    std::map<std::string, std::unique_ptr<IntColumn>> columns;
+    std::unique_ptr<PathIndex> path_index;
+    std::string source;
+    SourceSpans spans;
+
+    PathMatch select_and_remember(const std::string& path, const std::vector<Path>& steps);
+    void invalidate_caches();
+    JsonValue& mutable_document();
 };
 
-void printJsonValue(const JsonValue &value);
\ No newline at end of file
+void printJsonValue(const JsonValue &value);
+void printJsonValue(const JsonValue &value, std::ostream &out);
+
+// Like printJsonValue, except that containers `storage` has the input text
+// of (see JsonStorage::source_text) are written as that text, without the
+// whitespace between tokens if `minify` is set. Values the query built,
+// like the array of a wildcard match, are printed around them.
+void printJsonSource(const JsonValue &value, const JsonStorage &storage, std::ostream &out, bool minify = false);
\ No newline at end of file
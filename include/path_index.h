@@ -0,0 +1,44 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+struct JsonValue;
+
+// Hash map from full path expressions (a.b[3], a["x y"]) to the node they
+// resolve to, so repeated lookups on a hot document are a single probe
+// instead of a walk from the root. Entries point into the document and must
+// be dropped whenever it changes.
+class PathIndex {
+public:
+    static constexpr std::size_t DefaultBudget = 64 << 20;
+
+    struct Stats {
+        std::size_t entries = 0;
+        std::size_t bytes = 0;                      // Estimated memory held by the entries
+        std::size_t budget = 0;
+        std::chrono::microseconds build_time{0};    // Time spent in build()
+        bool complete = false;                      // build() indexed every node
+    };
+
+    explicit PathIndex(std::size_t budgetBytes = DefaultBudget);
+
+    // Indexes every node below root breadth first, so when the budget runs
+    // out it is the deepest paths that are missing.
+    void build(const JsonValue &root);
+
+    const JsonValue *find(const std::string &path) const;
+
+    // Adds a single path, returns false once the budget is used up
+    bool insert(const std::string &path, const JsonValue *node);
+
+    void clear();
+    const Stats &stats() const { return info; }
+
+private:
+    std::unordered_map<std::string, const JsonValue *> entries;
+    Stats info;
+
+    static std::size_t entryBytes(const std::string &path);
+};
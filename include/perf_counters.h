@@ -0,0 +1,41 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Hardware performance counters of the calling thread, read around a phase
+// through perf_event_open. Counters that cannot be opened (no PMU in a VM,
+// perf_event_paranoid, seccomp, a non-Linux build) are marked unavailable
+// rather than failing, so callers can always wrap a phase in start()/stop().
+class PerfCounters {
+public:
+    enum Event { Cycles, Instructions, BranchMisses, CacheMisses, TlbMisses };
+    static constexpr std::size_t EventCount = 5;
+
+    struct Reading {
+        std::array<std::uint64_t, EventCount> values{};
+        std::array<bool, EventCount> available{};
+
+        std::uint64_t operator[](Event event) const { return values[event]; }
+        bool has(Event event) const { return available[event]; }
+    };
+
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    // Whether at least one counter could be opened
+    bool available() const;
+
+    // Resets and enables the counters, stop() disables them and returns the
+    // counts since start(), scaled up when the kernel had to multiplex them
+    void start();
+    Reading stop();
+
+    static const char *eventName(Event event);
+
+private:
+    std::array<int, EventCount> descriptors;
+};
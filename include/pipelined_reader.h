@@ -0,0 +1,67 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <fstream>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Stream buffer over a file that is read on a background thread in
+// fixed-size blocks. Blocks go through a small ring of buffers, so the disk
+// keeps reading ahead while the parser works on earlier blocks and the total
+// time approaches max(read, parse) rather than read + parse.
+//
+//     PipelinedFileReader reader(path);
+//     std::istream input(&reader);
+//     JsonStorage storage(input);
+class PipelinedFileReader : public std::streambuf {
+public:
+    static constexpr std::size_t DefaultBlockSize = 1 << 20;
+    static constexpr std::size_t DefaultBlockCount = 4;
+
+    struct Timings {
+        std::chrono::microseconds read{0};  // Reader thread busy reading the file
+        std::chrono::microseconds wait{0};  // Consumer blocked on a block not read yet
+        std::size_t bytes = 0;
+        std::size_t blocks = 0;
+    };
+
+    explicit PipelinedFileReader(const std::string &path, std::size_t blockSize = DefaultBlockSize,
+                                 std::size_t blockCount = DefaultBlockCount);
+    ~PipelinedFileReader() override;
+
+    PipelinedFileReader(const PipelinedFileReader &) = delete;
+    PipelinedFileReader &operator=(const PipelinedFileReader &) = delete;
+
+    bool is_open() const { return opened; }
+
+    // Complete once the consumer has reached the end of the file
+    Timings timings();
+
+protected:
+    int_type underflow() override;
+
+private:
+    struct Block {
+        std::vector<char> data;
+        std::size_t size = 0;
+    };
+
+    std::ifstream file;
+    bool opened = false;
+    std::vector<Block> ring;     // Block n lives in ring[n % ring.size()]
+    std::size_t produced = 0;    // Blocks read so far
+    std::size_t consumed = 0;    // Blocks handed back by the consumer
+    bool holding = false;        // Consumer is reading block `consumed`
+    bool finished = false;       // Reader hit the end of the file (or an error)
+    bool stopping = false;
+    Timings stats;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread reader;
+
+    void run();
+};
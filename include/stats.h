@@ -0,0 +1,85 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Allocations made through operator new since the process started. The
+// counters are process-wide relaxed atomics, so a difference of two readings
+// also includes what other threads allocated in between.
+struct AllocationCounters {
+    std::uint64_t count = 0;
+    std::uint64_t bytes = 0;
+
+    AllocationCounters operator-(const AllocationCounters &earlier) const {
+        return {count - earlier.count, bytes - earlier.bytes};
+    }
+
+    AllocationCounters &operator+=(const AllocationCounters &other) {
+        count += other.count;
+        bytes += other.bytes;
+        return *this;
+    }
+};
+
+AllocationCounters allocationCounters();
+
+// Call sites allocations are attributed to. Only builds with
+// JSON_EVAL_TRACK_ALLOCATIONS tell them apart; in other builds every
+// category stays zero and AllocationScope compiles to nothing.
+enum class AllocationCategory { Other, ObjectNode, ArrayGrowth, String, ExpressionTemporary };
+constexpr std::size_t AllocationCategoryCount = 5;
+
+const char *allocationCategoryName(AllocationCategory category);
+
+struct CategoryAllocations {
+    std::array<AllocationCounters, AllocationCategoryCount> counters{};
+
+    const AllocationCounters &operator[](AllocationCategory category) const {
+        return counters[static_cast<std::size_t>(category)];
+    }
+
+    CategoryAllocations operator-(const CategoryAllocations &earlier) const {
+        CategoryAllocations result;
+        for (std::size_t i = 0; i < AllocationCategoryCount; ++i) {
+            result.counters[i] = counters[i] - earlier.counters[i];
+        }
+        return result;
+    }
+
+    CategoryAllocations &operator+=(const CategoryAllocations &other) {
+        for (std::size_t i = 0; i < AllocationCategoryCount; ++i) {
+            counters[i] += other.counters[i];
+        }
+        return *this;
+    }
+};
+
+CategoryAllocations allocationsByCategory();
+
+// Attributes the allocations of the current thread to `category` while it
+// is alive. Scopes nest, the innermost one wins. Work handed to other
+// threads (e.g. parallel filters) counts as Other.
+#ifdef JSON_EVAL_TRACK_ALLOCATIONS
+class AllocationScope {
+public:
+    explicit AllocationScope(AllocationCategory category);
+    ~AllocationScope();
+
+    AllocationScope(const AllocationScope &) = delete;
+    AllocationScope &operator=(const AllocationScope &) = delete;
+
+private:
+    AllocationCategory previous;
+};
+#else
+class AllocationScope {
+public:
+    explicit AllocationScope(AllocationCategory) {}
+};
+#endif
+
+// Largest resident set size of the process so far, 0 where unknown
+std::uint64_t peakResidentBytes();
+
+double megabytesPerSecond(std::uint64_t bytes, std::chrono::microseconds time);
@@ -0,0 +1,39 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for data-parallel loops over large arrays.
+class ThreadPool {
+public:
+    explicit ThreadPool(std::size_t workers);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Process-wide pool with one worker less than there are hardware threads,
+    // the thread calling parallel_for makes up for the difference.
+    static ThreadPool &shared();
+
+    std::size_t size() const { return threads.size(); }
+
+    // Calls body(begin, end) for consecutive chunks of [0, count) and returns
+    // once all of them are done. The calling thread works on chunks too, so
+    // nested calls from inside a body cannot deadlock. The first exception
+    // thrown by a body is rethrown here.
+    void parallel_for(std::size_t count, std::size_t chunk, const std::function<void(std::size_t, std::size_t)> &body);
+
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable available;
+    bool stopping = false;
+
+    void run();
+};
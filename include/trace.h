@@ -0,0 +1,58 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// Optional tracing of where time goes, per thread. Spans are recorded into
+// a ring buffer owned by the recording thread and written out as Chrome
+// trace_event JSON, which loads in Perfetto (ui.perfetto.dev) and
+// chrome://tracing. While tracing is disabled a span costs one relaxed load.
+class Tracer {
+public:
+    // Spans kept per thread; older ones are overwritten
+    static constexpr std::size_t BufferCapacity = 1 << 16;
+
+    static void enable(bool on = true);
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+    // Label for the calling thread in the trace, e.g. "file reader". Cheap
+    // enough to call unconditionally when a thread starts.
+    static void setThreadName(const char *name);
+
+    // Writes the spans of all threads, including ones that have exited
+    static void dump(std::ostream &out);
+    static void clear();
+
+    // Called by TraceSpan. `name` must outlive the trace, string literals do.
+    static void record(const char *name, std::chrono::steady_clock::time_point start,
+                       std::chrono::steady_clock::time_point end);
+
+private:
+    static std::atomic<bool> active;
+};
+
+// Records the time between construction and destruction as a span. A null
+// name records nothing, for spans that only apply some of the time.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *name) : name(Tracer::enabled() ? name : nullptr) {
+        if (this->name) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~TraceSpan() {
+        if (name) {
+            Tracer::record(name, start, std::chrono::steady_clock::now());
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    const char *name;
+    std::chrono::steady_clock::time_point start;
+};
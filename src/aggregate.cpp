@@ -0,0 +1,118 @@
+#include "aggregate.h"
+#include <algorithm>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define AGGREGATE_HAVE_AVX2_KERNEL 1
+#endif
+
+void IntAggregate::merge(const IntAggregate &other) {
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    count += other.count;
+}
+
+namespace {
+
+// Four independent accumulators per statistic break the dependency chain
+// between iterations, which lets the compiler keep them in vector lanes.
+IntAggregate aggregateIntsPortable(const int *values, std::size_t count) {
+    constexpr std::size_t Lanes = 4;
+    long long sums[Lanes] = {0, 0, 0, 0};
+    int mins[Lanes];
+    int maxs[Lanes];
+    std::fill(mins, mins + Lanes, std::numeric_limits<int>::max());
+    std::fill(maxs, maxs + Lanes, std::numeric_limits<int>::min());
+
+    std::size_t i = 0;
+    for (; i + Lanes <= count; i += Lanes) {
+        for (std::size_t lane = 0; lane < Lanes; ++lane) {
+            int value = values[i + lane];
+            sums[lane] += value;
+            mins[lane] = std::min(mins[lane], value);
+            maxs[lane] = std::max(maxs[lane], value);
+        }
+    }
+    for (; i < count; ++i) {
+        sums[0] += values[i];
+        mins[0] = std::min(mins[0], values[i]);
+        maxs[0] = std::max(maxs[0], values[i]);
+    }
+
+    IntAggregate result;
+    result.count = count;
+    for (std::size_t lane = 0; lane < Lanes; ++lane) {
+        result.sum += sums[lane];
+        result.min = std::min(result.min, mins[lane]);
+        result.max = std::max(result.max, maxs[lane]);
+    }
+    return result;
+}
+
+#ifdef AGGREGATE_HAVE_AVX2_KERNEL
+__attribute__((target("avx2")))
+IntAggregate aggregateIntsAvx2(const int *values, std::size_t count) {
+    // Two blocks of 8 ints per iteration, each with its own min/max
+    // accumulators; sums are widened to 64 bit lanes to avoid overflow.
+    __m256i min0 = _mm256_set1_epi32(std::numeric_limits<int>::max());
+    __m256i min1 = min0;
+    __m256i max0 = _mm256_set1_epi32(std::numeric_limits<int>::min());
+    __m256i max1 = max0;
+    __m256i sum0 = _mm256_setzero_si256();
+    __m256i sum1 = _mm256_setzero_si256();
+
+    std::size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(values + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(values + i + 8));
+        min0 = _mm256_min_epi32(min0, a);
+        min1 = _mm256_min_epi32(min1, b);
+        max0 = _mm256_max_epi32(max0, a);
+        max1 = _mm256_max_epi32(max1, b);
+        __m256i ab = _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(a)),
+                                      _mm256_cvtepi32_epi64(_mm256_extracti128_si256(a, 1)));
+        __m256i bb = _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(b)),
+                                      _mm256_cvtepi32_epi64(_mm256_extracti128_si256(b, 1)));
+        sum0 = _mm256_add_epi64(sum0, ab);
+        sum1 = _mm256_add_epi64(sum1, bb);
+    }
+
+    alignas(32) int mins[8];
+    alignas(32) int maxs[8];
+    alignas(32) long long sums[4];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(mins), _mm256_min_epi32(min0, min1));
+    _mm256_store_si256(reinterpret_cast<__m256i *>(maxs), _mm256_max_epi32(max0, max1));
+    _mm256_store_si256(reinterpret_cast<__m256i *>(sums), _mm256_add_epi64(sum0, sum1));
+
+    IntAggregate result = aggregateIntsPortable(values + i, count - i);
+    for (int lane = 0; lane < 8; ++lane) {
+        result.min = std::min(result.min, mins[lane]);
+        result.max = std::max(result.max, maxs[lane]);
+    }
+    for (int lane = 0; lane < 4; ++lane) {
+        result.sum += sums[lane];
+    }
+    result.count = count;
+    return result;
+}
+#endif
+
+} // namespace
+
+IntAggregate aggregateInts(const int *values, std::size_t count) {
+#ifdef AGGREGATE_HAVE_AVX2_KERNEL
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    if (hasAvx2) {
+        return aggregateIntsAvx2(values, count);
+    }
+#endif
+    return aggregateIntsPortable(values, count);
+}
+
+void IntBlockReducer::flush() {
+    if (pending > 0) {
+        total.merge(aggregateInts(block, pending));
+        pending = 0;
+    }
+}
@@ -0,0 +1,55 @@
+#include "column.h"
+#include <algorithm>
+
+void IntColumn::append(const int *value) {
+    if (rows % 64 == 0) {
+        validity.push_back(0);
+    }
+    if (value) {
+        values.push_back(*value);
+        validity.back() |= std::uint64_t(1) << (rows % 64);
+        ++valid_count;
+    } else {
+        values.push_back(0);
+    }
+    ++rows;
+}
+
+IntAggregate IntColumn::aggregate() const {
+    if (valid_count == rows) {
+        return aggregateInts(values.data(), rows);
+    }
+
+    IntAggregate result;
+    IntBlockReducer scattered;
+    std::size_t runStart = 0;
+    std::size_t runLength = 0;
+    for (std::size_t word = 0; word < validity.size(); ++word) {
+        std::size_t base = word * 64;
+        std::size_t width = std::min<std::size_t>(64, rows - base);
+        std::uint64_t full = width == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << width) - 1;
+        std::uint64_t bits = validity[word];
+
+        if (bits == full) {
+            if (runLength == 0) {
+                runStart = base;
+            }
+            runLength += width;
+            continue;
+        }
+
+        if (runLength > 0) {
+            result.merge(aggregateInts(values.data() + runStart, runLength));
+            runLength = 0;
+        }
+        while (bits) {
+            scattered.push(values[base + __builtin_ctzll(bits)]);
+            bits &= bits - 1;
+        }
+    }
+    if (runLength > 0) {
+        result.merge(aggregateInts(values.data() + runStart, runLength));
+    }
+    result.merge(scattered.finish());
+    return result;
+}
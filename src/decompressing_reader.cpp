@@ -0,0 +1,213 @@
+#include "decompressing_reader.h"
+#include "trace.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifdef JSON_EVAL_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef JSON_EVAL_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Decompresses as much of `in` into `out` as fits. Returns true when the
+// current gzip member or zstd frame is complete; reset() starts the next one.
+struct DecompressingStreamBuf::Decoder {
+    virtual ~Decoder() = default;
+    virtual bool decode(const char *in, std::size_t inSize, std::size_t &consumed,
+                        char *out, std::size_t outSize, std::size_t &produced) = 0;
+    virtual void reset() = 0;
+};
+
+namespace {
+
+#ifdef JSON_EVAL_HAVE_ZLIB
+struct GzipDecoder : DecompressingStreamBuf::Decoder {
+    z_stream stream{};
+
+    GzipDecoder() {
+        // 15 + 16: largest window, expect a gzip header
+        if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+            throw std::runtime_error("Could not initialize gzip decoder");
+        }
+    }
+
+    ~GzipDecoder() override {
+        inflateEnd(&stream);
+    }
+
+    bool decode(const char *in, std::size_t inSize, std::size_t &consumed,
+                char *out, std::size_t outSize, std::size_t &produced) override {
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+        stream.avail_in = static_cast<uInt>(inSize);
+        stream.next_out = reinterpret_cast<Bytef *>(out);
+        stream.avail_out = static_cast<uInt>(outSize);
+        int status = inflate(&stream, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+            throw std::runtime_error(std::string("Corrupt gzip input: ") + (stream.msg ? stream.msg : "inflate failed"));
+        }
+        consumed = inSize - stream.avail_in;
+        produced = outSize - stream.avail_out;
+        return status == Z_STREAM_END;
+    }
+
+    void reset() override {
+        inflateReset(&stream);
+    }
+};
+#endif
+
+#ifdef JSON_EVAL_HAVE_ZSTD
+struct ZstdDecoder : DecompressingStreamBuf::Decoder {
+    ZSTD_DCtx *context = ZSTD_createDCtx();
+
+    ZstdDecoder() {
+        if (!context) {
+            throw std::runtime_error("Could not initialize zstd decoder");
+        }
+    }
+
+    ~ZstdDecoder() override {
+        ZSTD_freeDCtx(context);
+    }
+
+    bool decode(const char *in, std::size_t inSize, std::size_t &consumed,
+                char *out, std::size_t outSize, std::size_t &produced) override {
+        ZSTD_inBuffer inBuffer{in, inSize, 0};
+        ZSTD_outBuffer outBuffer{out, outSize, 0};
+        std::size_t result = ZSTD_decompressStream(context, &outBuffer, &inBuffer);
+        if (ZSTD_isError(result)) {
+            throw std::runtime_error(std::string("Corrupt zstd input: ") + ZSTD_getErrorName(result));
+        }
+        consumed = inBuffer.pos;
+        produced = outBuffer.pos;
+        return result == 0;
+    }
+
+    void reset() override {
+        ZSTD_DCtx_reset(context, ZSTD_reset_session_only);
+    }
+};
+#endif
+
+bool startsWith(const std::vector<char> &data, std::size_t size, const unsigned char *magic, std::size_t length) {
+    return size >= length && std::memcmp(data.data(), magic, length) == 0;
+}
+
+} // namespace
+
+bool DecompressingStreamBuf::supports(Format format) {
+    switch (format) {
+        case Plain:
+            return true;
+        case Gzip:
+#ifdef JSON_EVAL_HAVE_ZLIB
+            return true;
+#else
+            return false;
+#endif
+        case Zstd:
+#ifdef JSON_EVAL_HAVE_ZSTD
+            return true;
+#else
+            return false;
+#endif
+    }
+    return false;
+}
+
+DecompressingStreamBuf::DecompressingStreamBuf(std::streambuf &source, std::size_t bufferSize)
+    : source(source), input(std::max<std::size_t>(bufferSize, 4)) {
+    refill();
+
+    static constexpr unsigned char gzipMagic[] = {0x1f, 0x8b};
+    static constexpr unsigned char zstdMagic[] = {0x28, 0xb5, 0x2f, 0xfd};
+    if (startsWith(input, inputSize, gzipMagic, sizeof(gzipMagic))) {
+        detected = Gzip;
+    } else if (startsWith(input, inputSize, zstdMagic, sizeof(zstdMagic))) {
+        detected = Zstd;
+    } else {
+        return;
+    }
+    if (!supports(detected)) {
+        throw std::runtime_error(std::string(detected == Gzip ? "gzip" : "zstd") + " input is not supported by this build");
+    }
+
+#ifdef JSON_EVAL_HAVE_ZLIB
+    if (detected == Gzip) {
+        decoder = std::make_unique<GzipDecoder>();
+    }
+#endif
+#ifdef JSON_EVAL_HAVE_ZSTD
+    if (detected == Zstd) {
+        decoder = std::make_unique<ZstdDecoder>();
+    }
+#endif
+    output.resize(input.size());
+}
+
+DecompressingStreamBuf::~DecompressingStreamBuf() = default;
+
+// Moves unread input to the front and fills up the rest from the source.
+// Returns false when no new bytes could be read.
+bool DecompressingStreamBuf::refill() {
+    if (sourceDone) {
+        return false;
+    }
+    std::memmove(input.data(), input.data() + inputPos, inputSize - inputPos);
+    inputSize -= inputPos;
+    inputPos = 0;
+    std::streamsize wanted = static_cast<std::streamsize>(input.size() - inputSize);
+    std::streamsize read = source.sgetn(input.data() + inputSize, wanted);
+    inputSize += static_cast<std::size_t>(read);
+    sourceDone = read < wanted;
+    return read > 0;
+}
+
+DecompressingStreamBuf::int_type DecompressingStreamBuf::underflow() {
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    if (detected == Plain) {
+        // Hand out the input buffer directly, nothing to decode
+        if (inputPos == inputSize && !refill()) {
+            return traits_type::eof();
+        }
+        setg(input.data() + inputPos, input.data() + inputPos, input.data() + inputSize);
+        handedOut += inputSize - inputPos;
+        inputPos = inputSize;
+        return traits_type::to_int_type(*gptr());
+    }
+
+    TraceSpan span("decompress block");
+    while (true) {
+        if (inputPos == inputSize && !refill()) {
+            if (!frameEnded) {
+                throw std::runtime_error("Truncated compressed input");
+            }
+            return traits_type::eof();
+        }
+        if (frameEnded) {
+            // Concatenated gzip members / zstd frames form one stream
+            decoder->reset();
+            frameEnded = false;
+        }
+
+        std::size_t consumed = 0;
+        std::size_t produced = 0;
+        frameEnded = decoder->decode(input.data() + inputPos, inputSize - inputPos, consumed,
+                                     output.data(), output.size(), produced);
+        inputPos += consumed;
+        if (produced > 0) {
+            setg(output.data(), output.data(), output.data() + produced);
+            handedOut += produced;
+            return traits_type::to_int_type(*gptr());
+        }
+        if (!frameEnded && consumed == 0 && !refill()) {
+            throw std::runtime_error("Truncated compressed input");
+        }
+    }
+}
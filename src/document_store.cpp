@@ -0,0 +1,29 @@
+#include "document_store.h"
+
+DocumentStore::DocumentStore(const std::string &jsonContent)
+    : DocumentStore(std::make_shared<JsonValue>(JsonParser().parse(jsonContent)))
+{
+}
+
+DocumentStore::DocumentStore(std::shared_ptr<const JsonValue> document)
+    : current(std::make_shared<const Snapshot>(Snapshot{std::move(document), 1}))
+{
+}
+
+DocumentStore::Snapshot DocumentStore::snapshot() const {
+    return *current.load(std::memory_order_acquire);
+}
+
+std::uint64_t DocumentStore::publish(std::shared_ptr<const JsonValue> document) {
+    // Writers queue up behind each other so versions stay consecutive,
+    // readers never touch the mutex
+    std::lock_guard<std::mutex> lock(writer);
+    std::uint64_t version = current.load(std::memory_order_relaxed)->version + 1;
+    current.store(std::make_shared<const Snapshot>(Snapshot{std::move(document), version}), std::memory_order_release);
+    return version;
+}
+
+std::uint64_t DocumentStore::reload(const std::string &jsonContent) {
+    // Parsing happens before the swap, readers keep using the old version
+    return publish(std::make_shared<JsonValue>(JsonParser().parse(jsonContent)));
+}
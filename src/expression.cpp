@@ -1,24 +1,259 @@
 #include "expression.h"
+#include "trace.h"
+#include <array>
 #include <cctype>
+#include <climits>
+#include <cstdint>
 #include <stdexcept>
 
 ExpressionEvaluator::ExpressionEvaluator(JsonStorage &jsonStorage) : storage(jsonStorage) {
-    functionsMap["min"] = [this](const std::vector<JsonValue> &args) { return evaluateMinFunction(args); };
-    functionsMap["max"] = [this](const std::vector<JsonValue> &args) { return evaluateMaxFunction(args); };
-    functionsMap["size"] = [this](const std::vector<JsonValue> &args) { return evaluateSizeFunction(args); };
+}
+
+JsonValue EvalResult::materialize() const {
+    if (!multi_valued) {
+        return single();
+    }
+    JsonArray result;
+    result.reserve(match_count());
+    if (column) {
+        for (std::size_t row = 0; row < column->rows; ++row) {
+            if (column->is_valid(row)) {
+                result.push_back(JsonValue(column->values[row]));
+            }
+        }
+    }
+    for (const JsonValue *node : nodes) {
+        result.push_back(*node);
+    }
+    return JsonValue(result);
 }
 
 JsonValue ExpressionEvaluator::evaluate(const std::string &expression) {
+    auto start = std::chrono::steady_clock::now();
+    AllocationCounters allocations = allocationCounters();
+    CategoryAllocations byCategory = allocationsByCategory();
+    CompiledExpression compiled = compile(expression);
+    evaluationStats.compile_time +=
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    evaluationStats.allocations += allocationCounters() - allocations;
+    evaluationStats.allocations_by_category += allocationsByCategory() - byCategory;
+    return evaluate(compiled);
+}
+
+JsonValue ExpressionEvaluator::evaluate(const CompiledExpression &expression) {
+    TraceSpan span("evaluate expression");
+    auto start = std::chrono::steady_clock::now();
+    AllocationCounters allocations = allocationCounters();
+    CategoryAllocations byCategory = allocationsByCategory();
+    EvalContext context{&storage, &storage.root(), &storage.root()};
+    JsonValue result;
+    {
+        AllocationScope scope(AllocationCategory::ExpressionTemporary);
+        result = evaluateNode(expression.root, context).materialize();
+    }
+    evaluationStats.evaluations++;
+    evaluationStats.evaluate_time +=
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    evaluationStats.allocations += allocationCounters() - allocations;
+    evaluationStats.allocations_by_category += allocationsByCategory() - byCategory;
+    return result;
+}
+
+CompiledExpression ExpressionEvaluator::compile(const std::string &expression) const {
+    TraceSpan span("compile expression");
     std::size_t pos = 0;
-    JsonValue result = evaluateExpression(expression, pos);
+    ExpressionNode root = compileExpression(expression, pos, &userFunctions);
     skipWhitespace(expression, pos);
     if (pos != expression.length()) {
         throw std::runtime_error("Unexpected characters at end of expression");
     }
-    return result;
+    return CompiledExpression(std::move(root));
+}
+
+bool ExpressionEvaluator::matchesFilter(const ExpressionNode &predicate, const JsonValue &candidate, const JsonValue &root) {
+    EvalContext context{nullptr, &root, &candidate};
+    return isTruthy(evaluateNode(predicate, context));
+}
+
+// Subscriptions
+
+std::size_t ExpressionEvaluator::subscribe(CompiledExpression expression, SubscriptionCallback callback) {
+    std::vector<JsonPointer> paths = dependencies(expression.root);
+    std::size_t id = nextSubscription++;
+    auto it = subscriptions.emplace(id, Subscription{std::move(expression), std::move(paths), std::move(callback)}).first;
+    it->second.callback(evaluate(it->second.expression));
+    return id;
+}
+
+void ExpressionEvaluator::unsubscribe(std::size_t id) {
+    subscriptions.erase(id);
+}
+
+void ExpressionEvaluator::applyPatch(const std::string &patch) {
+    notifySubscribers(storage.apply_patch(patch));
+}
+
+void ExpressionEvaluator::applyMergePatch(const std::string &patch) {
+    notifySubscribers(storage.merge_patch(patch));
+}
+
+void ExpressionEvaluator::notifySubscribers(const std::vector<JsonPointer> &touched) {
+    for (auto &[id, subscription] : subscriptions) {
+        bool affected = std::any_of(subscription.dependencies.begin(), subscription.dependencies.end(),
+                                    [&touched](const JsonPointer &dependency) {
+                                        return std::any_of(touched.begin(), touched.end(), [&dependency](const JsonPointer &change) {
+                                            return pointersOverlap(dependency, change);
+                                        });
+                                    });
+        if (affected) {
+            subscription.callback(evaluate(subscription.expression));
+        }
+    }
+}
+
+std::vector<JsonPointer> ExpressionEvaluator::dependencies(const ExpressionNode &node) {
+    std::vector<JsonPointer> out;
+    collectDependencies(node, false, out);
+    return out;
+}
+
+// Inside filter predicates `@` paths stay below the filtered prefix, which is
+// a dependency already; everywhere else they start at the root.
+void ExpressionEvaluator::collectDependencies(const ExpressionNode &node, bool inFilter, std::vector<JsonPointer> &out) {
+    if (node.kind == ExpressionNode::PathRef && !(inFilter && node.relative)) {
+        collectPathDependencies(node.steps, out);
+    }
+    for (const ExpressionNode &arg : node.args) {
+        collectDependencies(arg, inFilter, out);
+    }
+}
+
+void ExpressionEvaluator::collectPathDependencies(const std::vector<Path> &steps, std::vector<JsonPointer> &out) {
+    // The prefix ends at the first step that is not a plain key or index,
+    // later steps can still read other paths
+    JsonPointer prefix;
+    bool plain = true;
+    for (const Path &step : steps) {
+        if (plain && step.is_object()) {
+            prefix.push_back(step.name);
+        } else if (plain && step.is_array()) {
+            prefix.push_back(std::to_string(step.array_index));
+        } else {
+            plain = false;
+            // Paths the step itself reads: dynamic indices and filter predicates
+            if (step.is_dynamic()) {
+                collectPathDependencies(step.index_path, out);
+            } else if (step.is_filter()) {
+                collectDependencies(*step.predicate, true, out);
+            }
+        }
+    }
+    out.push_back(std::move(prefix));
+}
+
+// Filter predicates
+//
+//   or         := and ('||' and)*
+//   and        := comparison ('&&' comparison)*
+//   comparison := '!' comparison | '(' or ')' | term (op term)?
+//
+// where a term is any expression: literal, path, `@` path or function call.
+// A term on its own tests whether it exists and is not 0.
+
+std::shared_ptr<const ExpressionNode> ExpressionEvaluator::compileFilter(const std::string &expression, std::size_t &pos) {
+    skipWhitespace(expression, pos);
+    if (pos >= expression.length() || expression[pos] != '(') {
+        throw std::runtime_error("Expected '(' after '?' in filter");
+    }
+    pos++; // Consume '('
+    ExpressionNode predicate = compileOr(expression, pos);
+    skipWhitespace(expression, pos);
+    if (pos >= expression.length() || expression[pos] != ')') {
+        throw std::runtime_error("Expected ')' at end of filter");
+    }
+    pos++; // Consume ')'
+    skipWhitespace(expression, pos);
+    return std::make_shared<const ExpressionNode>(std::move(predicate));
 }
 
-JsonValue ExpressionEvaluator::evaluateExpression(const std::string &expression, std::size_t &pos) {
+ExpressionNode ExpressionEvaluator::compileOr(const std::string &expression, std::size_t &pos) {
+    ExpressionNode node = compileAnd(expression, pos);
+    skipWhitespace(expression, pos);
+    while (expression.compare(pos, 2, "||") == 0) {
+        pos += 2; // Consume '||'
+        if (node.kind != ExpressionNode::Or) {
+            ExpressionNode first = std::move(node);
+            node = ExpressionNode();
+            node.kind = ExpressionNode::Or;
+            node.args.push_back(std::move(first));
+        }
+        node.args.push_back(compileAnd(expression, pos));
+        skipWhitespace(expression, pos);
+    }
+    return node;
+}
+
+ExpressionNode ExpressionEvaluator::compileAnd(const std::string &expression, std::size_t &pos) {
+    ExpressionNode node = compileComparison(expression, pos);
+    skipWhitespace(expression, pos);
+    while (expression.compare(pos, 2, "&&") == 0) {
+        pos += 2; // Consume '&&'
+        if (node.kind != ExpressionNode::And) {
+            ExpressionNode first = std::move(node);
+            node = ExpressionNode();
+            node.kind = ExpressionNode::And;
+            node.args.push_back(std::move(first));
+        }
+        node.args.push_back(compileComparison(expression, pos));
+        skipWhitespace(expression, pos);
+    }
+    return node;
+}
+
+ExpressionNode ExpressionEvaluator::compileComparison(const std::string &expression, std::size_t &pos) {
+    skipWhitespace(expression, pos);
+    if (pos < expression.length() && expression[pos] == '!') {
+        pos++; // Consume '!'
+        ExpressionNode node;
+        node.kind = ExpressionNode::Not;
+        node.args.push_back(compileComparison(expression, pos));
+        return node;
+    }
+    if (pos < expression.length() && expression[pos] == '(') {
+        pos++; // Consume '('
+        ExpressionNode node = compileOr(expression, pos);
+        skipWhitespace(expression, pos);
+        if (pos >= expression.length() || expression[pos] != ')') {
+            throw std::runtime_error("Expected ')' in filter");
+        }
+        pos++; // Consume ')'
+        return node;
+    }
+
+    ExpressionNode lhs = compileExpression(expression, pos, nullptr);
+    skipWhitespace(expression, pos);
+
+    // Two-character operators first so "<=" is not read as "<"
+    static constexpr std::pair<std::string_view, ExpressionNode::CompareOp> operators[] = {
+        {"==", ExpressionNode::Equal}, {"!=", ExpressionNode::NotEqual},
+        {"<=", ExpressionNode::LessEqual}, {">=", ExpressionNode::GreaterEqual},
+        {"<", ExpressionNode::Less}, {">", ExpressionNode::Greater},
+    };
+    for (const auto &[token, op] : operators) {
+        if (expression.compare(pos, token.size(), token) == 0) {
+            pos += token.size();
+            ExpressionNode node;
+            node.kind = ExpressionNode::Compare;
+            node.op = op;
+            node.args.push_back(std::move(lhs));
+            node.args.push_back(compileExpression(expression, pos, nullptr));
+            return node;
+        }
+    }
+    return lhs;
+}
+
+ExpressionNode ExpressionEvaluator::compileExpression(const std::string &expression, std::size_t &pos, const FunctionMap *userFunctions) {
     skipWhitespace(expression, pos);
 
     if (pos >= expression.length()) {
@@ -31,28 +266,36 @@ JsonValue ExpressionEvaluator::evaluateExpression(const std::string &expression,
         while (pos < expression.length() && (std::isalnum(expression[pos]) || expression[pos] == '_')) {
             pos++;
         }
-        std::string identifier = expression.substr(start, pos - start);
 
         skipWhitespace(expression, pos);
 
         if (pos < expression.length() && expression[pos] == '(') {
             // Function call
             pos = start; // Reset position to start of function name
-            return parseFunctionCall(expression, pos);
+            return compileFunctionCall(expression, pos, userFunctions);
         } else {
             // Path
             pos = start; // Reset position to start of identifier
-            return parsePathOrLiteral(expression, pos);
+            return compilePathOrLiteral(expression, pos);
         }
     } else if (std::isdigit(expression[pos]) || expression[pos] == '-') {
         // Parse number literal
-        return parsePathOrLiteral(expression, pos);
+        return compilePathOrLiteral(expression, pos);
+    } else if (expression[pos] == '.' || expression[pos] == '@') {
+        // Path starting with recursive descent (..id) or at the current node (@.id)
+        return compilePath(expression, pos);
+    } else if (expression[pos] == '"') {
+        // Parse string literal
+        ExpressionNode node;
+        node.kind = ExpressionNode::Literal;
+        node.literal = JsonValue(JsonPathEvalator::parseStringInExpression(expression, pos));
+        return node;
     } else {
         throw std::runtime_error(std::string("Invalid character in expression: ") + expression[pos]);
     }
 }
 
-JsonValue ExpressionEvaluator::parseFunctionCall(const std::string &expression, std::size_t &pos) {
+ExpressionNode ExpressionEvaluator::compileFunctionCall(const std::string &expression, std::size_t &pos, const FunctionMap *userFunctions) {
     // Parse function name
     std::size_t start = pos;
     while (pos < expression.length() && (std::isalnum(expression[pos]) || expression[pos] == '_')) {
@@ -68,11 +311,16 @@ JsonValue ExpressionEvaluator::parseFunctionCall(const std::string &expression,
     pos++; // Consume '('
     skipWhitespace(expression, pos);
 
+    ExpressionNode node;
+    node.kind = ExpressionNode::Call;
+    node.function = findFunction(functionName, userFunctions);
+    if (!node.function) {
+        throw std::runtime_error("Unknown function: " + functionName);
+    }
+
     // Parse arguments
-    std::vector<JsonValue> args;
     while (pos < expression.length() && expression[pos] != ')') {
-        JsonValue arg = evaluateExpression(expression, pos);
-        args.push_back(arg);
+        node.args.push_back(compileExpression(expression, pos, userFunctions));
 
         skipWhitespace(expression, pos);
 
@@ -91,16 +339,114 @@ JsonValue ExpressionEvaluator::parseFunctionCall(const std::string &expression,
     }
     pos++; // Consume ')'
 
-    // Look up the function and evaluate
-    auto it = functionsMap.find(functionName);
-    if (it == functionsMap.end()) {
-        throw std::runtime_error("Unknown function: " + functionName);
+    const FunctionInfo &function = *node.function;
+    if (node.args.size() < function.min_arity || node.args.size() > function.max_arity) {
+        std::string expected = function.min_arity == function.max_arity
+            ? "exactly " + std::to_string(function.min_arity)
+            : function.max_arity == FunctionInfo::Variadic
+                ? "at least " + std::to_string(function.min_arity)
+                : "between " + std::to_string(function.min_arity) + " and " + std::to_string(function.max_arity);
+        throw std::runtime_error(functionName + " function requires " + expected + " argument(s), got " +
+                                 std::to_string(node.args.size()));
+    }
+
+    checkArgumentTypes(node);
+    foldConstants(node);
+    return node;
+}
+
+// Compile-time passes
+
+static const char *typeName(JsonValue::Type type) {
+    switch (type) {
+        case JsonValue::INT: return "int";
+        case JsonValue::STRING: return "string";
+        case JsonValue::OBJECT: return "object";
+        case JsonValue::ARRAY: return "array";
+    }
+    return "unknown";
+}
+
+TypeMask ExpressionEvaluator::staticType(const ExpressionNode &node) {
+    switch (node.kind) {
+        case ExpressionNode::Literal:
+            return typeBit(node.literal.type);
+        case ExpressionNode::Call:
+            return node.function->result_types;
+        case ExpressionNode::Compare:
+        case ExpressionNode::And:
+        case ExpressionNode::Or:
+        case ExpressionNode::Not:
+            return typeBit(JsonValue::INT);
+        case ExpressionNode::PathRef:
+            break;
+    }
+    return AnyType; // Only known once a document is queried
+}
+
+// Rejects arguments whose static type can never be accepted, e.g. size(3) or
+// sum("x"). Paths are only known once a document is queried and always pass.
+void ExpressionEvaluator::checkArgumentTypes(const ExpressionNode &node) {
+    const FunctionInfo &function = *node.function;
+    for (const ExpressionNode &arg : node.args) {
+        TypeMask type = staticType(arg);
+        if ((type & function.arg_types) == 0) {
+            for (JsonValue::Type candidate : {JsonValue::INT, JsonValue::STRING, JsonValue::OBJECT, JsonValue::ARRAY}) {
+                if (type & typeBit(candidate)) {
+                    throw std::runtime_error(std::string(function.name) + " function does not accept " +
+                                             typeName(candidate) + " arguments");
+                }
+            }
+        }
+    }
+}
+
+void ExpressionEvaluator::foldConstants(ExpressionNode &node) {
+    const FunctionInfo &function = *node.function;
+    auto isLiteral = [](const ExpressionNode &arg) { return arg.kind == ExpressionNode::Literal; };
+
+    // Pure call on constants: evaluate once now
+    if (function.pure && std::all_of(node.args.begin(), node.args.end(), isLiteral)) {
+        std::vector<EvalResult> args(node.args.size());
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            args[i].value = node.args[i].literal;
+        }
+        JsonValue value = function.impl(args);
+        node.kind = ExpressionNode::Literal;
+        node.literal = value;
+        node.function = nullptr;
+        node.args.clear();
+        return;
     }
 
-    return it->second(args);
+    // min/max: of all constant arguments only the best one can win. At least
+    // one argument is not constant here, so two or more arguments remain and
+    // the single-array rule of the aggregates is not triggered by folding.
+    bool pickMax = function.impl == &ExpressionEvaluator::evaluateMaxFunction;
+    if (!pickMax && function.impl != &ExpressionEvaluator::evaluateMinFunction) {
+        return;
+    }
+    const ExpressionNode *best = nullptr;
+    for (const ExpressionNode &arg : node.args) {
+        if (isLiteral(arg) && (!best || (pickMax ? compareJsonValues(best->literal, arg.literal)
+                                                 : compareJsonValues(arg.literal, best->literal)))) {
+            best = &arg;
+        }
+    }
+    if (!best) {
+        return;
+    }
+    std::vector<ExpressionNode> kept;
+    kept.reserve(node.args.size());
+    for (ExpressionNode &arg : node.args) {
+        if (!isLiteral(arg) || &arg == best) {
+            kept.push_back(std::move(arg));
+        }
+    }
+    node.args = std::move(kept);
 }
 
-JsonValue ExpressionEvaluator::parsePathOrLiteral(const std::string &expression, std::size_t &pos) {
+ExpressionNode ExpressionEvaluator::compilePathOrLiteral(const std::string &expression, std::size_t &pos) {
     skipWhitespace(expression, pos);
 
     if (pos >= expression.length()) {
@@ -122,11 +468,13 @@ JsonValue ExpressionEvaluator::parsePathOrLiteral(const std::string &expression,
             throw std::runtime_error("Invalid number literal");
         }
         std::string numberStr = expression.substr(start, pos - start);
-        int number = std::stoi(numberStr);
-        return JsonValue(number);
+        ExpressionNode node;
+        node.kind = ExpressionNode::Literal;
+        node.literal = JsonValue(std::stoi(numberStr));
+        return node;
     } else {
         // Parse path
-        return parsePath(expression, pos);
+        return compilePath(expression, pos);
     }
 }
 
@@ -134,8 +482,14 @@ inline bool isIdentifierChar(char c) {
     return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
 }
 
-JsonValue ExpressionEvaluator::parsePath(const std::string &expression, std::size_t &pos) {
-    std::string path;
+ExpressionNode ExpressionEvaluator::compilePath(const std::string &expression, std::size_t &pos) {
+    ExpressionNode node;
+    node.kind = ExpressionNode::PathRef;
+    if (expression[pos] == '@') {
+        pos++; // Consume '@', the rest is relative to the current node
+        node.relative = true;
+    }
+    std::string &path = node.path;
     while (pos < expression.length()) {
         if (isIdentifierChar(expression[pos])) {
             // Collect identifier
@@ -144,14 +498,21 @@ JsonValue ExpressionEvaluator::parsePath(const std::string &expression, std::siz
                 pos++;
             }
             path += expression.substr(start, pos - start);
-        } else if (expression[pos] == '.') {
-            // Dot separator
+        } else if (expression[pos] == '.' || expression[pos] == '*') {
+            // Dot separator or `.*` wildcard
             path += expression[pos++];
         } else if (expression[pos] == '[') {
             // Handle brackets
             path += expression[pos++];
             int brackets = 1;
             while (pos < expression.length() && brackets > 0) {
+                if (expression[pos] == '"') {
+                    // Brackets inside quoted keys or filter strings do not count
+                    std::size_t start = pos;
+                    JsonPathEvalator::parseStringInExpression(expression, pos);
+                    path += expression.substr(start, pos - start);
+                    continue;
+                }
                 if (expression[pos] == '[') {
                     brackets++;
                 } else if (expression[pos] == ']') {
@@ -166,52 +527,359 @@ JsonValue ExpressionEvaluator::parsePath(const std::string &expression, std::siz
             break;
         }
     }
-    return storage.get(path);
+    node.steps = JsonPathEvalator::compile(path);
+    return node;
+}
+
+EvalResult ExpressionEvaluator::evaluateNode(const ExpressionNode &node, const EvalContext &context) {
+    switch (node.kind) {
+        case ExpressionNode::Literal: {
+            EvalResult result;
+            result.value = node.literal;
+            return result;
+        }
+        case ExpressionNode::PathRef:
+            return evaluatePath(node, context);
+        case ExpressionNode::Call: {
+            std::vector<EvalResult> args;
+            args.reserve(node.args.size());
+            bool aggregate = node.function->aggregate;
+            for (const ExpressionNode &arg : node.args) {
+                args.push_back(aggregate && arg.kind == ExpressionNode::PathRef ? evaluatePath(arg, context, true)
+                                                                                : evaluateNode(arg, context));
+            }
+            EvalResult result;
+            result.value = node.function->impl(args);
+            return result;
+        }
+        case ExpressionNode::Compare:
+        case ExpressionNode::And:
+        case ExpressionNode::Or:
+        case ExpressionNode::Not: {
+            bool holds;
+            if (node.kind == ExpressionNode::Compare) {
+                holds = evaluateComparison(node, context);
+            } else if (node.kind == ExpressionNode::Not) {
+                holds = !isTruthy(evaluateNode(node.args[0], context));
+            } else {
+                // Short-circuits like && and || in C++
+                bool isAnd = node.kind == ExpressionNode::And;
+                holds = isAnd;
+                for (const ExpressionNode &arg : node.args) {
+                    if (isTruthy(evaluateNode(arg, context)) != isAnd) {
+                        holds = !isAnd;
+                        break;
+                    }
+                }
+            }
+            EvalResult result;
+            result.value = JsonValue(holds ? 1 : 0);
+            return result;
+        }
+    }
+    throw std::runtime_error("Invalid expression node");
+}
+
+EvalResult ExpressionEvaluator::evaluatePath(const ExpressionNode &node, const EvalContext &context, bool aggregateArgument) {
+    EvalResult result;
+    if (context.storage && !node.relative) {
+        const IntColumn *column = aggregateArgument && JsonPathEvalator::is_projectable(node.steps)
+                                      ? context.storage->column(node.path, node.steps)
+                                      : nullptr;
+        if (column) {
+            result.multi_valued = true;
+            result.column = column;
+            return result;
+        }
+
+        PathMatch match = context.storage->select(node.path, node.steps);
+        result.multi_valued = match.multi_valued;
+        result.elements = std::move(match.elements);
+        if (match.multi_valued) {
+            result.nodes = std::move(match.nodes);
+        } else {
+            result.ref = match.nodes.front();
+        }
+        return result;
+    }
+
+    // Inside filters a missing path is no error, it just matches nothing
+    JsonPathEvalator evaluator(node.relative ? *context.current : *context.root);
+    PathMatch match = evaluator.select(node.steps, true);
+    result.multi_valued = match.multi_valued || match.nodes.size() != 1;
+    result.elements = std::move(match.elements);
+    if (result.multi_valued) {
+        result.nodes = std::move(match.nodes);
+    } else {
+        result.ref = match.nodes.front();
+    }
+    return result;
+}
+
+// Comparisons with a multi-valued side hold if they hold for any of its
+// values. Only ints and strings are ordered, and only among themselves;
+// equality compares any two values deeply.
+bool ExpressionEvaluator::evaluateComparison(const ExpressionNode &node, const EvalContext &context) {
+    EvalResult lhs = evaluateNode(node.args[0], context);
+    EvalResult rhs = evaluateNode(node.args[1], context);
+    auto operands = [](const EvalResult &result) {
+        NodeList values;
+        if (result.multi_valued) {
+            values = result.nodes;
+        } else {
+            values.push_back(&result.single());
+        }
+        return values;
+    };
+
+    auto holds = [op = node.op](const JsonValue &a, const JsonValue &b) {
+        if (op == ExpressionNode::Equal) {
+            return a == b;
+        }
+        if (op == ExpressionNode::NotEqual) {
+            return !(a == b);
+        }
+        if (a.type != b.type || (a.type != JsonValue::INT && a.type != JsonValue::STRING)) {
+            return false;
+        }
+        bool less = compareJsonValues(a, b);
+        bool greater = compareJsonValues(b, a);
+        switch (op) {
+            case ExpressionNode::Less: return less;
+            case ExpressionNode::LessEqual: return !greater;
+            case ExpressionNode::Greater: return greater;
+            case ExpressionNode::GreaterEqual: return !less;
+            default: return false;
+        }
+    };
+
+    for (const JsonValue *a : operands(lhs)) {
+        for (const JsonValue *b : operands(rhs)) {
+            if (holds(*a, *b)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// A term used as a condition holds if it matched something that is not 0
+bool ExpressionEvaluator::isTruthy(const EvalResult &result) {
+    if (result.multi_valued) {
+        return result.match_count() > 0;
+    }
+    const JsonValue &value = result.single();
+    return value.type != JsonValue::INT || value.asInt() != 0;
+}
+
+// Function registry
+
+namespace {
+
+// FNV-1a with a seed, usable in constant expressions
+constexpr std::uint32_t hashFunctionName(std::string_view name, std::uint32_t seed) {
+    std::uint32_t hash = 2166136261u ^ seed;
+    for (char c : name) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+constexpr std::size_t FunctionTableSize = 16;
+
+// Smallest seed for which every name lands in its own slot
+template <std::size_t N>
+constexpr std::uint32_t findPerfectSeed(const FunctionInfo (&functions)[N]) {
+    for (std::uint32_t seed = 0;; ++seed) {
+        bool used[FunctionTableSize] = {};
+        bool collision = false;
+        for (const FunctionInfo &function : functions) {
+            std::size_t slot = hashFunctionName(function.name, seed) % FunctionTableSize;
+            collision |= used[slot];
+            used[slot] = true;
+        }
+        if (!collision) {
+            return seed;
+        }
+    }
 }
 
+template <std::size_t N>
+constexpr std::array<const FunctionInfo *, FunctionTableSize> buildFunctionTable(const FunctionInfo (&functions)[N], std::uint32_t seed) {
+    std::array<const FunctionInfo *, FunctionTableSize> table = {};
+    for (const FunctionInfo &function : functions) {
+        table[hashFunctionName(function.name, seed) % FunctionTableSize] = &function;
+    }
+    return table;
+}
+
+} // namespace
+
+const FunctionInfo *ExpressionEvaluator::findBuiltin(std::string_view name) {
+    static constexpr FunctionInfo builtins[] = {
+        {"min", 1, FunctionInfo::Variadic, &ExpressionEvaluator::evaluateMinFunction, AnyType, AnyType, true, true},
+        {"max", 1, FunctionInfo::Variadic, &ExpressionEvaluator::evaluateMaxFunction, AnyType, AnyType, true, true},
+        {"size", 1, 1, &ExpressionEvaluator::evaluateSizeFunction,
+         typeBit(JsonValue::STRING) | typeBit(JsonValue::OBJECT) | typeBit(JsonValue::ARRAY), typeBit(JsonValue::INT), true, true},
+        {"sum", 1, FunctionInfo::Variadic, &ExpressionEvaluator::evaluateSumFunction,
+         typeBit(JsonValue::INT) | typeBit(JsonValue::ARRAY), typeBit(JsonValue::INT), true, true},
+        {"avg", 1, FunctionInfo::Variadic, &ExpressionEvaluator::evaluateAvgFunction,
+         typeBit(JsonValue::INT) | typeBit(JsonValue::ARRAY), typeBit(JsonValue::INT), true, true},
+        {"count", 1, FunctionInfo::Variadic, &ExpressionEvaluator::evaluateCountFunction, AnyType, typeBit(JsonValue::INT), true, true},
+    };
+    static_assert(std::size(builtins) <= FunctionTableSize, "function table too small");
+    static constexpr std::uint32_t seed = findPerfectSeed(builtins);
+    static constexpr auto table = buildFunctionTable(builtins, seed);
+
+    const FunctionInfo *function = table[hashFunctionName(name, seed) % FunctionTableSize];
+    return function && function->name == name ? function : nullptr;
+}
+
+const FunctionInfo *ExpressionEvaluator::findFunction(const std::string &name, const FunctionMap *userFunctions) {
+    if (const FunctionInfo *builtin = findBuiltin(name)) {
+        return builtin;
+    }
+    if (!userFunctions) {
+        return nullptr;
+    }
+    auto it = userFunctions->find(name);
+    return it != userFunctions->end() ? &it->second : nullptr;
+}
+
+void ExpressionEvaluator::registerFunction(const std::string &name, std::size_t minArity, std::size_t maxArity, FunctionImpl impl,
+                                           TypeMask argTypes, TypeMask resultTypes, bool pure) {
+    if (findBuiltin(name)) {
+        throw std::runtime_error("Cannot redefine built-in function: " + name);
+    }
+    if (minArity > maxArity || !impl) {
+        throw std::runtime_error("Invalid definition of function: " + name);
+    }
+    auto it = userFunctions.insert_or_assign(name, FunctionInfo{}).first;
+    it->second = FunctionInfo{it->first, minArity, maxArity, impl, argTypes, resultTypes, pure};
+}
 
 // Function evaluators
 
-JsonValue ExpressionEvaluator::evaluateMinFunction(const std::vector<JsonValue> &args) {
-    if (args.empty()) {
-        throw std::runtime_error("min function requires at least one argument");
+// Calls visit for every value an aggregate ranges over. A single array or
+// multi-valued argument is aggregated element-wise (max(a.b), sum(items[*].price));
+// otherwise the argument list itself is, with multi-valued arguments flattened.
+// Projected columns and the ints of packed arrays are handed over whole so
+// they can be scanned directly.
+template <typename Visitor, typename ColumnVisitor, typename IntsVisitor>
+static void forEachAggregateValue(const std::vector<EvalResult> &args, Visitor &&visit, ColumnVisitor &&visitColumn,
+                                  IntsVisitor &&visitInts) {
+    if (args.size() == 1 && !args[0].multi_valued && args[0].single().isArray()) {
+        if (const std::vector<int> *ints = args[0].single().packedInts()) {
+            visitInts(*ints);
+            return;
+        }
+        for (const JsonValue &element : args[0].single().asArray()) {
+            visit(element);
+        }
+        return;
+    }
+    for (const EvalResult &arg : args) {
+        if (arg.column) {
+            visitColumn(*arg.column);
+        } else if (arg.multi_valued) {
+            for (const JsonValue *node : arg.nodes) {
+                visit(*node);
+            }
+        } else {
+            visit(arg.single());
+        }
+    }
+}
+
+// Ints are reduced in blocks by the vectorized kernel, everything else goes
+// through compareJsonValues. Since INT orders before every other type, the
+// minimum is an int whenever there is one and the maximum never is when
+// another type is present.
+JsonValue ExpressionEvaluator::reduceExtreme(const std::vector<EvalResult> &args, bool pickMax) {
+    IntBlockReducer ints;
+    const JsonValue *bestOther = nullptr;
+    forEachAggregateValue(args, [&](const JsonValue &value) {
+        if (value.type == JsonValue::INT) {
+            ints.push(value.asInt());
+        } else if (!bestOther || (pickMax ? compareJsonValues(*bestOther, value) : compareJsonValues(value, *bestOther))) {
+            bestOther = &value;
+        }
+    }, [&ints](const IntColumn &column) { ints.add(column.aggregate()); },
+    [&ints](const std::vector<int> &values) { ints.add(aggregateInts(values.data(), values.size())); });
+
+    IntAggregate aggregate = ints.finish();
+    if (aggregate.count == 0 && !bestOther) {
+        throw std::runtime_error(std::string(pickMax ? "max" : "min") + " function has no values to compare");
     }
+    if (pickMax) {
+        return bestOther ? *bestOther : JsonValue(aggregate.max);
+    }
+    return aggregate.count > 0 ? JsonValue(aggregate.min) : *bestOther;
+}
+
+IntAggregate ExpressionEvaluator::reduceNumeric(const std::vector<EvalResult> &args, const std::string &functionName) {
+    IntBlockReducer ints;
+    forEachAggregateValue(args, [&](const JsonValue &value) {
+        if (value.type != JsonValue::INT) {
+            throw std::runtime_error(functionName + " function requires numeric values");
+        }
+        ints.push(value.asInt());
+    }, [&ints](const IntColumn &column) { ints.add(column.aggregate()); },
+    [&ints](const std::vector<int> &values) { ints.add(aggregateInts(values.data(), values.size())); });
+    return ints.finish();
+}
+
+JsonValue ExpressionEvaluator::evaluateMinFunction(const std::vector<EvalResult> &args) {
+    return reduceExtreme(args, false);
+}
 
-    auto minIter = std::min_element(args.begin(), args.end(), [this](const JsonValue &lhs, const JsonValue &rhs) {
-        return compareJsonValues(lhs, rhs);
-    });
-    return *minIter;
+JsonValue ExpressionEvaluator::evaluateMaxFunction(const std::vector<EvalResult> &args) {
+    return reduceExtreme(args, true);
 }
 
-JsonValue ExpressionEvaluator::evaluateMaxFunction(const std::vector<JsonValue> &args) {
-    if (args.empty()) {
-        throw std::runtime_error("max function requires at least one argument");
+JsonValue ExpressionEvaluator::evaluateSizeFunction(const std::vector<EvalResult> &args) {
+    // The size of a multi-valued path is the number of nodes it matched
+    if (args[0].multi_valued) {
+        return JsonValue(static_cast<int>(args[0].match_count()));
     }
+    return getSize(args[0].single());
+}
 
-    auto maxIter = std::max_element(args.begin(), args.end(), [this](const JsonValue &lhs, const JsonValue &rhs) {
-        return compareJsonValues(lhs, rhs);
-    });
-    return *maxIter;
+JsonValue ExpressionEvaluator::evaluateSumFunction(const std::vector<EvalResult> &args) {
+    return JsonValue(clampToInt(reduceNumeric(args, "sum").sum));
 }
 
-JsonValue ExpressionEvaluator::evaluateSizeFunction(const std::vector<JsonValue> &args) {
-    if (args.size() != 1) {
-        throw std::runtime_error("size function requires exactly one argument");
+JsonValue ExpressionEvaluator::evaluateAvgFunction(const std::vector<EvalResult> &args) {
+    IntAggregate aggregate = reduceNumeric(args, "avg");
+    if (aggregate.count == 0) {
+        throw std::runtime_error("avg function has no values to average");
     }
-    return getSize(args[0]);
+    // Numbers are ints, so the average is truncated like integer division
+    return JsonValue(clampToInt(aggregate.sum / static_cast<long long>(aggregate.count)));
+}
+
+JsonValue ExpressionEvaluator::evaluateCountFunction(const std::vector<EvalResult> &args) {
+    std::size_t count = 0;
+    forEachAggregateValue(args, [&count](const JsonValue &) { ++count; },
+                          [&count](const IntColumn &column) { count += column.valid_count; },
+                          [&count](const std::vector<int> &values) { count += values.size(); });
+    return JsonValue(static_cast<int>(count));
 }
 
 // Utility functions
 
+int ExpressionEvaluator::clampToInt(long long value) {
+    // Same saturation as number parsing, JsonValue only holds ints
+    return static_cast<int>(std::clamp<long long>(value, INT_MIN, INT_MAX));
+}
+
 JsonValue ExpressionEvaluator::getSize(const JsonValue &value) {
     if (value.type == JsonValue::OBJECT) {
-        const JsonObject &obj = std::get<JsonObject>(value.value);
-        return JsonValue(static_cast<int>(obj.size()));
+        return JsonValue(static_cast<int>(value.memberCount()));
     } else if (value.type == JsonValue::ARRAY) {
-        const JsonArray &arr = std::get<JsonArray>(value.value);
-        return JsonValue(static_cast<int>(arr.size()));
+        return JsonValue(static_cast<int>(value.size()));
     } else if (value.type == JsonValue::STRING) {
-        const std::string &str = std::get<std::string>(value.value);
+        std::string_view str = value.asString();
         return JsonValue(static_cast<int>(str.size()));
     }
     throw std::runtime_error("Size not supported for given type");
@@ -245,9 +913,9 @@ bool ExpressionEvaluator::compareJsonValues(const JsonValue &lhs, const JsonValu
     // If types are the same, compare values
     switch (lhs.type) {
         case JsonValue::INT:
-            return std::get<int>(lhs.value) < std::get<int>(rhs.value);
+            return lhs.asInt() < rhs.asInt();
         case JsonValue::STRING:
-            return std::get<std::string>(lhs.value) < std::get<std::string>(rhs.value);
+            return lhs.asString() < rhs.asString();
         case JsonValue::ARRAY:
             return lhs.size() < rhs.size(); // Compare sizes
         case JsonValue::OBJECT:
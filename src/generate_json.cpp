@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Writes synthetic JSON corpora of a given size for benchmarking. Output is
+// streamed through a fixed buffer, so generating 10 GB costs no more memory
+// than 1 KB, and the same seed always gives the same file.
+//
+// Next to <output> it writes <output>.paths with query paths that exist in
+// the file (one per line) and <output>.path with the first of them.
+
+namespace {
+
+class Output {
+public:
+    explicit Output(const std::string &path) : file(std::fopen(path.c_str(), "wb")) {
+        if (!file) {
+            throw std::runtime_error("Could not open " + path + " for writing");
+        }
+        buffer.reserve(Capacity);
+    }
+
+    // Without close() the unwritten rest of the buffer is dropped, as it is
+    // when generation fails halfway
+    ~Output() {
+        if (file) {
+            std::fclose(file);
+        }
+    }
+
+    // Writes what is still buffered, throws if that or closing the file fails
+    void close() {
+        flush();
+        int result = std::fclose(file);
+        file = nullptr;
+        if (result != 0) {
+            throw std::runtime_error("Write failed");
+        }
+    }
+
+    Output &operator<<(const std::string &text) {
+        buffer += text;
+        written += text.size();
+        if (buffer.size() >= Capacity) {
+            flush();
+        }
+        return *this;
+    }
+
+    Output &operator<<(char c) {
+        buffer += c;
+        written++;
+        if (buffer.size() >= Capacity) {
+            flush();
+        }
+        return *this;
+    }
+
+    std::uint64_t size() const { return written; }
+
+private:
+    static constexpr std::size_t Capacity = 1 << 20;
+
+    std::FILE *file;
+    std::string buffer;
+    std::uint64_t written = 0;
+
+    void flush() {
+        if (!buffer.empty() && std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+            throw std::runtime_error("Write failed");
+        }
+        buffer.clear();
+    }
+};
+
+// Keeps a uniform sample of the paths offered so far, the total number of
+// elements is only known once the size target is reached
+class PathSample {
+public:
+    PathSample(std::mt19937_64 &rng, std::size_t capacity) : rng(rng), capacity(capacity) {}
+
+    void offer(const std::string &path) {
+        seen++;
+        if (paths.size() < capacity) {
+            paths.push_back(path);
+        } else if (std::uint64_t slot = rng() % seen; slot < capacity) {
+            paths[slot] = path;
+        }
+    }
+
+    const std::vector<std::string> &all() const { return paths; }
+
+private:
+    std::mt19937_64 &rng;
+    std::size_t capacity;
+    std::uint64_t seen = 0;
+    std::vector<std::string> paths;
+};
+
+struct Generator {
+    Generator(Output &out, std::uint64_t target, std::uint64_t seed, int depth)
+        : rng(seed), out(out), target(target), sample(rng, 16), depth(depth) {}
+
+    std::mt19937_64 rng;
+    Output &out;
+    std::uint64_t target;
+    PathSample sample;
+    int depth;
+
+    int number(int low, int high) {
+        return std::uniform_int_distribution<int>(low, high)(rng);
+    }
+
+    std::string word(int length) {
+        static const char letters[] = "abcdefghijklmnopqrstuvwxyz";
+        std::string result;
+        for (int i = 0; i < length; ++i) {
+            result += letters[rng() % 26];
+        }
+        return result;
+    }
+
+    // Mostly plain text with quotes, backslashes, control and \u escapes mixed in
+    std::string escapedText() {
+        static const char *escapes[] = {"\\\"", "\\\\", "\\n", "\\t", "\\/", "\\r", "\\u0041", "\\b"};
+        std::string result = "\"";
+        int parts = number(2, 8);
+        for (int i = 0; i < parts; ++i) {
+            result += word(number(1, 6));
+            result += escapes[rng() % 8];
+        }
+        return result + "\"";
+    }
+
+    // Shaped like small.json: wide objects keyed by numeric strings
+    void wide() {
+        out << "{\"areaNames\": {";
+        for (int i = 0; i < 16; ++i) {
+            out << (i ? ", " : "") << "\"" + std::to_string(205705993 + i) + "\": \"" + word(12) + "\"";
+        }
+        out << "}, \"events\": {";
+        for (std::uint64_t i = 0; out.size() < target || i == 0; ++i) {
+            std::string id = std::to_string(138586341 + i);
+            out << (i ? ", " : "") << "\"" + id + "\": {\"id\": " + id + ", \"name\": \"" + word(number(5, 20)) +
+                                      "\", \"topicIds\": [" + std::to_string(number(1, 1 << 30)) + ", " +
+                                      std::to_string(number(1, 1 << 30)) + "], \"logo\": null}";
+            sample.offer("events[\"" + id + "\"].name");
+            sample.offer("events[\"" + id + "\"].topicIds[1]");
+        }
+        out << "}}";
+    }
+
+    // An array of chains of nested objects, `depth` levels each
+    void deep() {
+        std::string chainPath;
+        for (int level = 0; level < depth; ++level) {
+            chainPath += ".k" + std::to_string(level);
+        }
+        out << "{\"chains\": [";
+        for (std::uint64_t i = 0; out.size() < target || i == 0; ++i) {
+            out << (i ? ", " : "");
+            for (int level = 0; level < depth; ++level) {
+                out << "{\"k" + std::to_string(level) + "\": ";
+            }
+            out << "{\"leaf\": " + std::to_string(number(0, 1000)) + "}";
+            out << std::string(depth, '}');
+            sample.offer("chains[" + std::to_string(i) + "]" + chainPath + ".leaf");
+        }
+        out << "]}";
+    }
+
+    // One large array of ints
+    void numbers() {
+        out << "{\"values\": [";
+        for (std::uint64_t i = 0; out.size() < target || i == 0; ++i) {
+            out << (i ? "," : "") << std::to_string(number(-1000000, 1000000));
+            sample.offer("values[" + std::to_string(i) + "]");
+        }
+        out << "]}";
+    }
+
+    // Newline-delimited records; json_eval reads the first one, so the
+    // paths are those of the first record
+    void ndjson() {
+        for (std::uint64_t i = 0; out.size() < target || i == 0; ++i) {
+            out << "{\"id\": " + std::to_string(i) + ", \"user\": {\"name\": \"" + word(8) + "\", \"tags\": [\"" +
+                       word(4) + "\", \"" + word(4) + "\"]}, \"score\": " + std::to_string(number(0, 100)) + "}\n";
+        }
+        for (const char *path : {"id", "user.name", "user.tags[1]", "score"}) {
+            sample.offer(path);
+        }
+    }
+
+    void escapes() {
+        out << "{\"messages\": [";
+        for (std::uint64_t i = 0; out.size() < target || i == 0; ++i) {
+            out << (i ? ", " : "") << "{\"id\": " + std::to_string(i) + ", \"text\": " + escapedText() + "}";
+            sample.offer("messages[" + std::to_string(i) + "].text");
+        }
+        out << "]}";
+    }
+};
+
+void usage(const char *program) {
+    std::cerr << "Usage: " << program << " <output_file> <size_in_bytes> [--shape wide|deep|numbers|ndjson|escapes]"
+              << " [--seed N] [--depth N]" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string path = argv[1];
+    std::uint64_t size = std::strtoull(argv[2], nullptr, 10);
+    std::string shape = "wide";
+    std::uint64_t seed = 42;
+    int depth = 64;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        std::string flag = argv[i];
+        if (flag == "--shape") {
+            shape = argv[i + 1];
+        } else if (flag == "--seed") {
+            seed = std::strtoull(argv[i + 1], nullptr, 10);
+        } else if (flag == "--depth") {
+            depth = std::max(1, std::atoi(argv[i + 1]));
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    try {
+        std::vector<std::string> paths;
+        std::uint64_t written;
+        {
+            Output out(path);
+            Generator generator(out, size, seed, depth);
+            if (shape == "wide") {
+                generator.wide();
+            } else if (shape == "deep") {
+                generator.deep();
+            } else if (shape == "numbers") {
+                generator.numbers();
+            } else if (shape == "ndjson") {
+                generator.ndjson();
+            } else if (shape == "escapes") {
+                generator.escapes();
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            paths = generator.sample.all();
+            written = out.size();
+            out.close();
+        }
+
+        Output pathList(path + ".paths");
+        for (const std::string &query : paths) {
+            pathList << query << '\n';
+        }
+        pathList.close();
+        Output firstPath(path + ".path");
+        firstPath << paths.front();
+        firstPath.close();
+        std::cout << "Generated " << written << " bytes of " << shape << " JSON at: " << path << std::endl;
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
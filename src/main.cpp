@@ -8,26 +8,83 @@
 #include <stdexcept>
 #include <algorithm>
 #include <cctype>
+#include <chrono>
+#include <optional>
 
 #include "parser.h"
 #include "expression.h"
+#include "pipelined_reader.h"
+#include "perf_counters.h"
+#include "trace.h"
+
+// One line per phase. Ratios are per input byte and per parsed node where
+// given, IPC is instructions per cycle.
+static void printPhaseCounters(const char *phase, const PerfCounters::Reading &reading, std::uint64_t bytes = 0,
+                          std::uint64_t nodes = 0) {
+    std::cerr << "counters " << phase << ":";
+    for (std::size_t i = 0; i < PerfCounters::EventCount; ++i) {
+        auto event = static_cast<PerfCounters::Event>(i);
+        std::cerr << (i ? ", " : " ");
+        if (!reading.has(event)) {
+            std::cerr << PerfCounters::eventName(event) << " unavailable";
+            continue;
+        }
+        std::cerr << reading[event] << " " << PerfCounters::eventName(event);
+        if (bytes) {
+            std::cerr << " (" << static_cast<double>(reading[event]) / bytes << "/byte";
+            std::cerr << (nodes ? ", " + std::to_string(static_cast<double>(reading[event]) / nodes) + "/node)" : ")");
+        }
+    }
+    if (reading.has(PerfCounters::Cycles) && reading.has(PerfCounters::Instructions) && reading[PerfCounters::Cycles]) {
+        std::cerr << ", IPC " << static_cast<double>(reading[PerfCounters::Instructions]) / reading[PerfCounters::Cycles];
+    }
+    std::cerr << std::endl;
+}
 
 int main(int argc, char **argv) {
     if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <json_file> <expression>" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " <json_file> <expression> [--index] [--timings] [--stats] [--counters]"
+                  << " [--trace <trace.json>] [--dedup] [--raw] [--minify]" << std::endl;
         return 1;
     }
+    bool buildIndex = false;
+    bool reportTimings = false;
+    bool reportStats = false;
+    bool reportCounters = false;
+    bool minify = false;
+    ParseOptions parseOptions;
+    std::string tracePath;
+    for (int i = 3; i < argc; ++i) {
+        std::string flag = argv[i];
+        if (flag == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        }
+        buildIndex |= flag == "--index";
+        reportTimings |= flag == "--timings";
+        reportStats |= flag == "--stats";
+        reportCounters |= flag == "--counters";
+        parseOptions.deduplicate |= flag == "--dedup";
+        // Objects and arrays of the result are copied from the input as they
+        // were written, with --minify without the whitespace
+        minify |= flag == "--minify";
+        parseOptions.record_spans |= flag == "--raw" || minify;
+    }
+
+    // Spans of all threads, written as Chrome trace_event JSON at the end
+    if (!tracePath.empty()) {
+        Tracer::setThreadName("main");
+        Tracer::enable();
+    }
 
-    // Read JSON file
-    std::ifstream jsonFile(argv[1]);
-    if (!jsonFile.is_open()) {
+    // Read JSON file. Blocks are read on a separate thread while the parser
+    // consumes the ones already read, instead of reading everything first.
+    auto start = std::chrono::steady_clock::now();
+    PipelinedFileReader reader(argv[1]);
+    if (!reader.is_open()) {
         std::cerr << "Error: Could not open file " << argv[1] << std::endl;
         return 1;
     }
-
-    std::stringstream buffer;
-    buffer << jsonFile.rdbuf();
-    std::string jsonContent = buffer.str();
+    std::istream jsonInput(&reader);
     // std::cout << "Got file" << std::endl;
     // std::cout << jsonContent << std::endl;
     // std::cout << "expression: " <<  argv[2] << std::endl;
@@ -41,13 +98,113 @@ int main(int argc, char **argv) {
         // JsonPathEvalator evaluator(json);
         // JsonValue result = evaluator.evaluate(argv[2]);
 
-        JsonStorage js(jsonContent);
+        // Counters follow this thread only: parse includes decompression
+        // but not the reader thread's I/O
+        // Opened only for --counters, they cost a syscall per event and phase
+        std::optional<PerfCounters> counters;
+        if (reportCounters) {
+            counters.emplace();
+            if (!counters->available()) {
+                std::cerr << "counters: unavailable, perf_event_open failed (no PMU, perf_event_paranoid or seccomp)"
+                          << std::endl;
+                counters.reset();
+                reportCounters = false;
+            }
+        }
+        auto startCounters = [&counters] {
+            if (counters) {
+                counters->start();
+            }
+        };
+        auto stopCounters = [&counters] { return counters ? counters->stop() : PerfCounters::Reading(); };
+        startCounters();
+        JsonStorage js(jsonInput, parseOptions);
+        PerfCounters::Reading parseReading = stopCounters();
+        if (reportTimings) {
+            // Parse time is the time spent not waiting for the reader
+            using std::chrono::microseconds;
+            PipelinedFileReader::Timings timings = reader.timings();
+            auto total = std::chrono::duration_cast<microseconds>(std::chrono::steady_clock::now() - start);
+            std::cerr << "read: " << timings.read.count() << " us (" << timings.bytes << " bytes in "
+                      << timings.blocks << " blocks), parse: " << (total - timings.wait).count()
+                      << " us, waited for input: " << timings.wait.count() << " us, total: " << total.count()
+                      << " us" << std::endl;
+        }
+        if (buildIndex) {
+            const PathIndex::Stats &stats = js.build_index().stats();
+            std::cerr << "index: " << stats.entries << " paths, " << stats.bytes << " bytes, built in "
+                      << stats.build_time.count() << " us" << (stats.complete ? "" : " (budget reached)") << std::endl;
+        }
         ExpressionEvaluator ee(js);
         // Print result
         std::cout << "result: ";
+        startCounters();
         JsonValue val = ee.evaluate(argv[2]);
-        printJsonValue(val);
-        std::cout << std::endl;
+        PerfCounters::Reading evaluateReading = stopCounters();
+        auto printStart = std::chrono::steady_clock::now();
+        startCounters();
+        {
+            TraceSpan span("print result");
+            if (parseOptions.record_spans) {
+                printJsonSource(val, js, std::cout, minify);
+            } else {
+                printJsonValue(val);
+            }
+            std::cout << std::endl;
+        }
+        PerfCounters::Reading printReading = stopCounters();
+        if (reportCounters) {
+            std::uint64_t nodes = 0;
+            for (std::uint64_t count : js.stats().nodes) {
+                nodes += count;
+            }
+            printPhaseCounters("parse", parseReading, js.stats().input_bytes, nodes);
+            printPhaseCounters("evaluate", evaluateReading);
+            printPhaseCounters("print", printReading);
+        }
+        if (reportStats) {
+            using std::chrono::microseconds;
+            auto print = std::chrono::duration_cast<microseconds>(std::chrono::steady_clock::now() - printStart);
+            const ParseStats &parse = js.stats();
+            const EvaluationStats &evaluation = ee.stats();
+            AllocationCounters total = allocationCounters();
+            PipelinedFileReader::Timings timings = reader.timings();
+            std::cerr << "read: " << timings.read.count() << " us, parse: " << parse.parse_time.count() << " us ("
+                      << parse.input_bytes << " bytes, " << parse.megabytes_per_second() << " MB/s, waited for input: "
+                      << timings.wait.count() << " us), compile: " << evaluation.compile_time.count()
+                      << " us, evaluate: " << evaluation.evaluate_time.count() << " us, print: " << print.count()
+                      << " us" << std::endl;
+            std::cerr << "nodes: " << parse.nodes[JsonValue::OBJECT] << " objects, " << parse.nodes[JsonValue::ARRAY]
+                      << " arrays, " << parse.nodes[JsonValue::STRING] << " strings, " << parse.nodes[JsonValue::INT]
+                      << " numbers" << std::endl;
+            if (parseOptions.deduplicate) {
+                std::cerr << "dedup: " << parse.subtrees << " objects and arrays, " << parse.distinct_subtrees
+                          << " stored, ratio " << parse.dedup_ratio() << std::endl;
+            }
+            std::cerr << "allocations: " << parse.allocations.count << " while parsing (" << parse.allocations.bytes
+                      << " bytes), " << evaluation.allocations.count << " while evaluating ("
+                      << evaluation.allocations.bytes << " bytes), " << total.count << " in total (" << total.bytes
+                      << " bytes)" << std::endl;
+#ifdef JSON_EVAL_TRACK_ALLOCATIONS
+            for (std::size_t i = 0; i < AllocationCategoryCount; ++i) {
+                auto category = static_cast<AllocationCategory>(i);
+                std::cerr << "  " << allocationCategoryName(category) << ": parse "
+                          << parse.allocations_by_category[category].count << " ("
+                          << parse.allocations_by_category[category].bytes << " bytes), query "
+                          << evaluation.allocations_by_category[category].count << " ("
+                          << evaluation.allocations_by_category[category].bytes << " bytes)" << std::endl;
+            }
+#endif
+            std::cerr << "peak RSS: " << peakResidentBytes() << " bytes" << std::endl;
+        }
+        if (!tracePath.empty()) {
+            std::ofstream trace(tracePath);
+            Tracer::dump(trace);
+            if (!trace) {
+                std::cerr << "Error: Could not write trace to " << tracePath << std::endl;
+                return 1;
+            }
+        }
     // } 
     
     // catch (const std::exception &e) {
@@ -0,0 +1,121 @@
+#include "minify.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define MINIFY_HAVE_AVX2_KERNEL 1
+#endif
+
+namespace {
+
+// Position in input and output, carried from the vector kernel to the
+// byte loop that finishes the tail
+struct MinifyState {
+    std::size_t in = 0;
+    std::size_t out = 0;
+    bool in_string = false;
+};
+
+bool isJsonWhitespace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+void minifyPortable(std::string_view text, char *out, MinifyState &state) {
+    for (; state.in < text.size(); ++state.in) {
+        char c = text[state.in];
+        if (state.in_string) {
+            out[state.out++] = c;
+            if (c == '\\' && state.in + 1 < text.size()) {
+                out[state.out++] = text[++state.in];
+            } else if (c == '"') {
+                state.in_string = false;
+            }
+        } else if (!isJsonWhitespace(c)) {
+            out[state.out++] = c;
+            state.in_string = c == '"';
+        }
+    }
+}
+
+#ifdef MINIFY_HAVE_AVX2_KERNEL
+// 32 bytes per step. Inside a string everything up to the next quote or
+// backslash is copied in one go; outside, chunks without whitespace are
+// stored as they are and the others compacted through the mask of bytes to
+// keep. Output never runs ahead of input, so the full-width stores stay
+// within the text.size() bytes `out` has.
+__attribute__((target("avx2")))
+void minifyAvx2(std::string_view text, char *out, MinifyState &state) {
+    const char *in = text.data();
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i carriageReturn = _mm256_set1_epi8('\r');
+    const __m256i tab = _mm256_set1_epi8('\t');
+
+    while (state.in + 32 <= text.size()) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + state.in));
+        auto quotes = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, quote)));
+        if (state.in_string) {
+            std::uint32_t stops =
+                quotes | static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, backslash)));
+            if (!stops) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + state.out), chunk);
+                state.in += 32;
+                state.out += 32;
+                continue;
+            }
+            // Up to and including the stop
+            std::size_t length = __builtin_ctz(stops) + 1;
+            std::memcpy(out + state.out, in + state.in, length);
+            state.in += length;
+            state.out += length;
+            if (in[state.in - 1] == '"') {
+                state.in_string = false;
+            } else if (state.in < text.size()) {
+                out[state.out++] = in[state.in++];  // The escaped character
+            }
+            continue;
+        }
+
+        __m256i whitespace = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, space),
+                                                             _mm256_cmpeq_epi8(chunk, newline)),
+                                             _mm256_or_si256(_mm256_cmpeq_epi8(chunk, carriageReturn),
+                                                             _mm256_cmpeq_epi8(chunk, tab)));
+        auto keep = ~static_cast<std::uint32_t>(_mm256_movemask_epi8(whitespace));
+        // A quote starts a string, the rest of the chunk is looked at again
+        std::size_t length = 32;
+        if (quotes) {
+            length = __builtin_ctz(quotes) + 1;
+            keep &= length == 32 ? ~0u : (1u << length) - 1;
+            state.in_string = true;
+        }
+        if (keep == ~0u) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + state.out), chunk);
+            state.out += 32;
+        } else {
+            for (; keep; keep &= keep - 1) {
+                out[state.out++] = in[state.in + __builtin_ctz(keep)];
+            }
+        }
+        state.in += length;
+    }
+    minifyPortable(text, out, state);
+}
+#endif
+
+} // namespace
+
+std::size_t minifyJson(std::string_view text, char *out) {
+    MinifyState state;
+#ifdef MINIFY_HAVE_AVX2_KERNEL
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    if (hasAvx2) {
+        minifyAvx2(text, out, state);
+        return state.out;
+    }
+#endif
+    minifyPortable(text, out, state);
+    return state.out;
+}
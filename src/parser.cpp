@@ -2,18 +2,428 @@
 #include <cassert>
 #include "parser.h"
 #include <cassert>
+#include "expression.h"
+#include "thread_pool.h"
+#include "decompressing_reader.h"
+#include "trace.h"
+#include "minify.h"
 
 #include <limits>
 
 #include <climits>
+std::optional<std::uint64_t> numericKey(std::string_view key) {
+    // 19 digits always fit, and a leading zero would not survive the round trip
+    if (key.empty() || key.size() > 19 || (key[0] == '0' && key.size() > 1)) {
+        return std::nullopt;
+    }
+    std::uint64_t number = 0;
+    auto [end, error] = std::from_chars(key.data(), key.data() + key.size(), number);
+    if (error != std::errc() || end != key.data() + key.size()) {
+        return std::nullopt;
+    }
+    return number;
+}
+
+// Implementation of Shape
+
+Shape::Shape(std::vector<std::string> sortedKeys) : key_list(std::move(sortedKeys)) {
+    slots.reserve(key_list.size());
+    for (std::size_t slot = 0; slot < key_list.size(); ++slot) {
+        slots.emplace(key_list[slot], static_cast<std::uint32_t>(slot));
+    }
+}
+
+// Implementation of JsonValue
+
+JsonValue::JsonValue(std::string_view v) : type(STRING) {
+    setString(v);
+}
+
+JsonValue::JsonValue(const JsonObject &v) : JsonValue(JsonObject(v)) {}
+
+JsonValue::JsonValue(JsonObject &&v) : type(OBJECT), inline_length(0) {
+    auto *block = new ObjectBlock();
+    block->members = std::move(v);
+    store<RefCounted *>(block);
+}
+
+JsonValue::JsonValue(const JsonArray &v) : JsonValue(JsonArray(v)) {}
+
+JsonValue::JsonValue(JsonArray &&v) : type(ARRAY), inline_length(0) {
+    auto *block = new ArrayBlock();
+    block->elements = std::move(v);
+    store<RefCounted *>(block);
+}
+
+JsonValue JsonValue::packedArray(std::vector<int> values) {
+    JsonValue result;
+    result.type = ARRAY;
+    result.inline_length = Packed;
+    result.store<RefCounted *>(new PackedInts(std::move(values)));
+    return result;
+}
+
+JsonValue JsonValue::shapedObject(std::shared_ptr<const Shape> shape, std::vector<JsonValue> values) {
+    JsonValue result;
+    result.type = OBJECT;
+    result.inline_length = Shaped;
+    result.store<RefCounted *>(new ShapedObject(std::move(shape), std::move(values)));
+    return result;
+}
+
+JsonValue JsonValue::intKeyedObject(IntKeyedObject object) {
+    JsonValue result;
+    result.type = OBJECT;
+    result.inline_length = IntKeyed;
+    result.store<RefCounted *>(new IntKeyedObject(std::move(object)));
+    return result;
+}
+
+JsonValue::JsonValue(const JsonValue &other) : type(INT), inline_length(0) {
+    copyFrom(other);
+}
+
+JsonValue &JsonValue::operator=(const JsonValue &other) {
+    if (this != &other) {
+        // Copy first, other may live inside this value
+        JsonValue copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+JsonValue &JsonValue::operator=(JsonValue &&other) noexcept {
+    if (this != &other) {
+        // Detach other before releasing, it may live inside this value
+        JsonValue moved(std::move(other));
+        release();
+        type = moved.type;
+        inline_length = moved.inline_length;
+        std::memcpy(payload, moved.payload, sizeof(payload));
+        moved.type = INT;
+        moved.inline_length = 0;
+    }
+    return *this;
+}
+
+void JsonValue::copyFrom(const JsonValue &other) {
+    switch (other.type) {
+        case INT:
+            inline_length = other.inline_length;
+            store(other.load<int>());
+            break;
+        case STRING:
+            setString(other.asString());
+            break;
+        case OBJECT:
+        case ARRAY: {
+            // Containers share the block until one side changes it, see detach()
+            RefCounted *block = other.load<RefCounted *>();
+            block->references.fetch_add(1, std::memory_order_relaxed);
+            inline_length = other.inline_length;
+            store(block);
+            break;
+        }
+    }
+    type = other.type;
+}
+
+// Several threads may read the same document, hence call_once
+const JsonArray &JsonValue::expanded() const {
+    const PackedInts *packed = blockAs<const PackedInts>();
+    std::call_once(packed->expand_once, [packed] {
+        AllocationScope scope(AllocationCategory::ArrayGrowth);
+        packed->expanded = std::make_unique<JsonArray>(packed->values.begin(), packed->values.end());
+    });
+    return *packed->expanded;
+}
+
+// Members are copied, so this is only for readers that need a JsonObject
+const JsonObject &JsonValue::expandedObject() const {
+    auto expand = [this] {
+        AllocationScope scope(AllocationCategory::ObjectNode);
+        auto expanded = std::make_unique<JsonObject>();
+        forEachMember([&expanded](std::string_view key, const JsonValue &member) {
+            expanded->emplace_hint(expanded->end(), key, member);
+        });
+        return expanded;
+    };
+    if (inline_length == IntKeyed) {
+        const IntKeyedObject *object = blockAs<const IntKeyedObject>();
+        std::call_once(object->expand_once, [&] { object->expanded = expand(); });
+        return *object->expanded;
+    }
+    const ShapedObject *object = blockAs<const ShapedObject>();
+    std::call_once(object->expand_once, [&] { object->expanded = expand(); });
+    return *object->expanded;
+}
+
+// Gives the value a plain JsonObject or JsonArray of its own before it is
+// modified. A block that other values still refer to is copied one level
+// deep, the members stay shared until they are modified in turn, so only
+// the path to a change is copied. Other forms are converted on the way.
+void JsonValue::detach() {
+    RefCounted *block = load<RefCounted *>();
+    bool unique = block->references.load(std::memory_order_acquire) == 1;
+    if (unique && inline_length == 0) {
+        return;
+    }
+    RefCounted *own;
+    if (type == OBJECT) {
+        auto *object = new ObjectBlock();
+        JsonObject &members = object->members;
+        if (inline_length == 0) {
+            members = blockAs<ObjectBlock>()->members;
+        } else {
+            AllocationScope scope(AllocationCategory::ObjectNode);
+            if (unique && inline_length == IntKeyed) {
+                IntKeyedObject *source = blockAs<IntKeyedObject>();
+                source->forEachPosition([&](std::size_t i) {
+                    members.emplace_hint(members.end(), std::to_string(source->keys[i]), std::move(source->values[i]));
+                });
+            } else if (unique && inline_length == Shaped) {
+                ShapedObject *source = blockAs<ShapedObject>();
+                for (std::size_t slot = 0; slot < source->values.size(); ++slot) {
+                    members.emplace_hint(members.end(), source->shape->keys()[slot], std::move(source->values[slot]));
+                }
+            } else {
+                forEachMember([&members](std::string_view key, const JsonValue &member) {
+                    members.emplace_hint(members.end(), key, member);
+                });
+            }
+        }
+        own = object;
+    } else {
+        auto *array = new ArrayBlock();
+        JsonArray &elements = array->elements;
+        if (inline_length == 0) {
+            elements = blockAs<ArrayBlock>()->elements;
+        } else {
+            PackedInts *packed = blockAs<PackedInts>();
+            AllocationScope scope(AllocationCategory::ArrayGrowth);
+            if (unique && packed->expanded) {
+                elements = std::move(*packed->expanded);
+            } else {
+                elements.assign(packed->values.begin(), packed->values.end());
+            }
+        }
+        own = array;
+    }
+    release();
+    inline_length = 0;
+    store(own);
+}
+
+void JsonValue::setString(std::string_view v) {
+    if (v.size() <= InlineCapacity) {
+        inline_length = static_cast<std::uint8_t>(v.size());
+        std::memcpy(payload, v.data(), v.size());
+        return;
+    }
+    if (v.size() > UINT32_MAX) {
+        throw std::runtime_error("String too long");
+    }
+    // One exact-size block, the length lives in the node
+    char *heap = new char[v.size()];
+    std::memcpy(heap, v.data(), v.size());
+    inline_length = LongString;
+    store(static_cast<std::uint32_t>(v.size()), LengthOffset);
+    store(heap);
+}
+
+void JsonValue::release() {
+    if (type == OBJECT || type == ARRAY) {
+        RefCounted *block = load<RefCounted *>();
+        if (block->references.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+    }
+    switch (type) {
+        case INT:
+            break;
+        case STRING:
+            if (inline_length == LongString) {
+                delete[] load<char *>();
+            }
+            break;
+        case OBJECT:
+            if (inline_length == Shaped) {
+                delete blockAs<ShapedObject>();
+            } else if (inline_length == IntKeyed) {
+                delete blockAs<IntKeyedObject>();
+            } else {
+                delete blockAs<ObjectBlock>();
+            }
+            break;
+        case ARRAY:
+            if (inline_length == Packed) {
+                delete blockAs<PackedInts>();
+            } else {
+                delete blockAs<ArrayBlock>();
+            }
+            break;
+    }
+}
+
+bool JsonValue::operator==(const JsonValue &other) const {
+    if (type != other.type) {
+        return false;
+    }
+    if (block() && block() == other.block()) {
+        return true;
+    }
+    switch (type) {
+        case INT:
+            return asInt() == other.asInt();
+        case STRING:
+            return asString() == other.asString();
+        case OBJECT: {
+            const ShapedObject *object = shaped();
+            const ShapedObject *otherObject = other.shaped();
+            if (object && otherObject && object->shape == otherObject->shape) {
+                return object->values == otherObject->values;
+            }
+            const IntKeyedObject *numbered = intKeyed();
+            const IntKeyedObject *otherNumbered = other.intKeyed();
+            if (numbered && otherNumbered) {
+                return numbered->keys == otherNumbered->keys && numbered->values == otherNumbered->values;
+            }
+            if (!object && !otherObject && !numbered && !otherNumbered) {
+                return asObject() == other.asObject();
+            }
+            if (memberCount() != other.memberCount()) {
+                return false;
+            }
+            bool equal = true;
+            forEachMember([&](std::string_view key, const JsonValue &member) {
+                const JsonValue *otherMember = equal ? other.find(key) : nullptr;
+                equal = otherMember && *otherMember == member;
+            });
+            return equal;
+        }
+        case ARRAY: {
+            // Compare packed ints as they are rather than expanding them
+            const std::vector<int> *ints = packedInts();
+            const std::vector<int> *otherInts = other.packedInts();
+            if (ints && otherInts) {
+                return *ints == *otherInts;
+            }
+            if (!ints && !otherInts) {
+                return asArray() == other.asArray();
+            }
+            const std::vector<int> &packed = ints ? *ints : *otherInts;
+            const JsonArray &nodes = ints ? other.asArray() : asArray();
+            return packed.size() == nodes.size() &&
+                   std::equal(packed.begin(), packed.end(), nodes.begin(), [](int value, const JsonValue &node) {
+                       return node.type == INT && node.asInt() == value;
+                   });
+        }
+    }
+    return false;
+}
+
 // Implementation of JsonParser methods
 
+// Shapes stay alive through the objects that use them
+void JsonParser::clearParseState() {
+    members.clear();
+    layouts.clear();
+    shapes.clear();
+    interned.clear();
+}
+
+namespace {
+
+// Stream buffer over another one that keeps every byte it hands out, so
+// spans can be recorded over input that is read only once. Positions count
+// from the start of the recorded text.
+class RecordingBuffer : public std::streambuf {
+public:
+    explicit RecordingBuffer(std::streambuf &input) : input(input) {}
+
+    std::string take() {
+        text.resize(filled);
+        return std::move(text);
+    }
+
+protected:
+    int_type underflow() override {
+        std::size_t position = gptr() - eback();
+        if (text.size() < filled + BlockSize) {
+            text.resize(std::max(2 * text.size(), filled + BlockSize));
+        }
+        std::streamsize read = input.sgetn(text.data() + filled, BlockSize);
+        if (read <= 0) {
+            return traits_type::eof();
+        }
+        filled += read;
+        setg(text.data(), text.data() + position, text.data() + filled);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    // Only tellg() is supported
+    pos_type seekoff(off_type offset, std::ios::seekdir direction, std::ios::openmode) override {
+        if (offset != 0 || direction != std::ios::cur) {
+            return pos_type(off_type(-1));
+        }
+        return pos_type(gptr() - eback());
+    }
+
+private:
+    static constexpr std::size_t BlockSize = 64 << 10;
+    std::streambuf &input;
+    std::string text;
+    std::size_t filled = 0;
+};
+
+} // namespace
+
 JsonValue JsonParser::parse(const std::string &jsonContent) {
+    depth = 0;
+    spans.clear();
+    if (options.record_spans) {
+        source = jsonContent;
+    }
     std::istringstream ss(jsonContent);
-    return parseValue(ss);
+    JsonValue result = parseValue(ss);
+    clearParseState();
+    return result;
+}
+
+JsonValue JsonParser::parse(std::istream &input) {
+    depth = 0;
+    spans.clear();
+    std::optional<RecordingBuffer> recorder;
+    std::optional<std::istream> recorded;
+    if (options.record_spans) {
+        recorder.emplace(*input.rdbuf());
+        recorded.emplace(&*recorder);
+    }
+    std::istream &stream = recorded ? *recorded : input;
+
+    // Let errors of the underlying stream buffer (e.g. corrupt compressed
+    // input) through instead of them looking like a premature end of input
+    std::ios::iostate previous = stream.exceptions();
+    stream.exceptions(previous | std::ios::badbit);
+    try {
+        JsonValue result = parseValue(stream);
+        stream.exceptions(previous);
+        clearParseState();
+        if (recorder) {
+            source = recorder->take();
+        }
+        return result;
+    } catch (...) {
+        stream.clear();
+        stream.exceptions(previous);
+        clearParseState();
+        throw;
+    }
 }
 
-JsonValue JsonParser::parseValue(std::istringstream &ss) {
+JsonValue JsonParser::parseValue(std::istream &ss) {
+    // Each member of the root is its own span in traces
+    TraceSpan span(depth == 1 ? "parse subtree" : nullptr);
     ss >> std::ws;
     
     // Peek the next character and use bitwise operations to decide the type.
@@ -34,10 +444,15 @@ JsonValue JsonParser::parseValue(std::istringstream &ss) {
     // Parse based on type
     JsonValue result;
 
+    std::size_t start = options.record_spans && (isObject | isArray) ? static_cast<std::size_t>(ss.tellg()) : 0;
+
     // Speculative execution without branching (in practice, a compiler may still branch here)
-    if(isObject)
+    if(isObject) {
+        depth++;
         result = parseObject(ss);
-    else if (isArray) {result = parseArray(ss);} 
+        depth--;
+    }
+    else if (isArray) {depth++; result = parseArray(ss); depth--;} 
     else if (isString) {result = parseString(ss);} 
     else if (isalnum) {result = parseNumber(ss);} 
 
@@ -55,14 +470,125 @@ JsonValue JsonParser::parseValue(std::istringstream &ss) {
 
         result = literal == "true" ? JsonValue(1) :
                  literal == "false" ? JsonValue(0) :
-                 literal == "null" ? JsonValue() :
+                 literal == "null" ? JsonValue::null() :
                  throw std::runtime_error("Invalid literal: " + literal);
     }
 
+    if (options.deduplicate && (isObject | isArray)) {
+        result = intern(std::move(result));
+    }
+    if (options.record_spans && (isObject | isArray)) {
+        // A deduplicated subtree keeps the span it was first seen at
+        std::size_t end = static_cast<std::size_t>(ss.tellg());
+        spans.try_emplace(result.block(), SourceSpan{start, end - start});
+    }
+    nodes[result.type]++;
     return result;
 }
 
-std::string JsonParser::parseString(std::istringstream &ss) {
+namespace {
+
+std::size_t mixHash(std::size_t seed, std::size_t value) {
+    return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
+// Subtrees are interned bottom up, so equal containers inside one share
+// their block by then and can be hashed and compared by address
+std::size_t memberHash(const JsonValue &value) {
+    if (const void *block = value.block()) {
+        return std::hash<const void *>()(block);
+    }
+    switch (value.type) {
+        case JsonValue::INT:
+            return std::hash<int>()(value.asInt());
+        case JsonValue::STRING:
+            return std::hash<std::string_view>()(value.asString());
+        default:
+            return value.size();
+    }
+}
+
+bool sameMember(const JsonValue &a, const JsonValue &b) {
+    if (a.block() || b.block()) {
+        return a.block() == b.block();
+    }
+    return a == b && a.isNull() == b.isNull();
+}
+
+std::size_t subtreeHash(const JsonValue &value) {
+    std::size_t hash = value.type;
+    if (const std::vector<int> *ints = value.packedInts()) {
+        for (int element : *ints) {
+            hash = mixHash(hash, std::hash<int>()(element));
+        }
+    } else if (value.isObject()) {
+        value.forEachMember([&hash](std::string_view key, const JsonValue &member) {
+            hash = mixHash(mixHash(hash, std::hash<std::string_view>()(key)), memberHash(member));
+        });
+    } else {
+        for (const JsonValue &element : value.asArray()) {
+            hash = mixHash(hash, memberHash(element));
+        }
+    }
+    return hash;
+}
+
+bool sameSubtree(const JsonValue &a, const JsonValue &b) {
+    if (a.type != b.type || a.size() != b.size()) {
+        return false;
+    }
+    const std::vector<int> *ints = a.packedInts();
+    const std::vector<int> *otherInts = b.packedInts();
+    if (ints || otherInts) {
+        return ints && otherInts && *ints == *otherInts;
+    }
+    if (a.isObject()) {
+        const ShapedObject *object = a.shaped();
+        const ShapedObject *other = b.shaped();
+        if (object && other) {
+            return object->shape == other->shape &&
+                   std::equal(object->values.begin(), object->values.end(), other->values.begin(), sameMember);
+        }
+        const IntKeyedObject *numbered = a.intKeyed();
+        const IntKeyedObject *otherNumbered = b.intKeyed();
+        if (numbered && otherNumbered) {
+            return numbered->keys == otherNumbered->keys &&
+                   std::equal(numbered->values.begin(), numbered->values.end(), otherNumbered->values.begin(),
+                              sameMember);
+        }
+        if (object || other || numbered || otherNumbered || a.memberCount() != b.memberCount()) {
+            return false;
+        }
+        const JsonObject &obj = a.asObject();
+        const JsonObject &otherObj = b.asObject();
+        return std::equal(obj.begin(), obj.end(), otherObj.begin(), [](const auto &x, const auto &y) {
+            return x.first == y.first && sameMember(x.second, y.second);
+        });
+    }
+    const JsonArray &arr = a.asArray();
+    const JsonArray &other = b.asArray();
+    return std::equal(arr.begin(), arr.end(), other.begin(), other.end(), sameMember);
+}
+
+} // namespace
+
+// Returns a copy of the stored identical subtree if there is one, sharing
+// its block, otherwise stores this one
+JsonValue JsonParser::intern(JsonValue value) {
+    subtrees++;
+    std::size_t hash = subtreeHash(value);
+    auto [first, last] = interned.equal_range(hash);
+    for (auto it = first; it != last; ++it) {
+        if (sameSubtree(it->second, value)) {
+            return it->second;
+        }
+    }
+    distinct_subtrees++;
+    return interned.emplace(hash, std::move(value))->second;
+}
+
+std::string JsonParser::parseString(std::istream &ss) {
+    AllocationScope scope(AllocationCategory::String);
     std::string result;
     char ch;
     ss.get(ch); // Assume the caller has already checked the opening '"'
@@ -127,7 +653,7 @@ int safe_stoi(const std::string& str) {
     }
 }
 
-int JsonParser::parseNumber(std::istringstream &ss) {
+int JsonParser::parseNumber(std::istream &ss) {
     std::string numberStr;
     char ch;
 
@@ -152,8 +678,10 @@ int JsonParser::parseNumber(std::istringstream &ss) {
 }
 
 
-JsonObject JsonParser::parseObject(std::istringstream &ss) {
-    JsonObject object;
+// Members are read onto the `members` stack, which nested objects share,
+// then stored by buildObject
+JsonValue JsonParser::parseObject(std::istream &ss) {
+    std::size_t first = members.size();
     char ch;
     ss.get(ch); // Consume '{'
     
@@ -162,7 +690,7 @@ JsonObject JsonParser::parseObject(std::istringstream &ss) {
     
     if (isEmptyObject) {
         ss.get(ch); // Consume '}'
-        return object; // Return empty object
+        return buildObject(first); // Empty object
     }
 
     while (true) {
@@ -174,7 +702,7 @@ JsonObject JsonParser::parseObject(std::istringstream &ss) {
         ss >> std::ws;
 
         JsonValue value = parseValue(ss); // Parse the value branchlessly
-        object[key] = value;
+        members.emplace_back(std::move(key), std::move(value));
 
         ss >> std::ws;
         int isComma = (ss.peek() == ',');
@@ -186,23 +714,151 @@ JsonObject JsonParser::parseObject(std::istringstream &ss) {
         }
     }
     
-    return object;
+    return buildObject(first);
+}
+
+// Stores the members from `first` on as a shaped object. The key order is
+// looked up among the layouts seen before, so the keys of a record are only
+// sorted and checked for duplicates the first time its layout turns up.
+JsonValue JsonParser::buildObject(std::size_t first) {
+    auto begin = members.begin() + first;
+    std::size_t count = members.size() - first;
+    if (count > 0 && numericKey(begin->first)) {
+        if (std::optional<JsonValue> object = buildIntKeyedObject(first)) {
+            return std::move(*object);
+        }
+    }
+    const ObjectLayout *layout = nullptr;
+    if (count <= MaxShapeKeys) {
+        std::size_t hash = count;
+        for (auto it = begin; it != members.end(); ++it) {
+            hash = hash * 31 + std::hash<std::string>()(it->first);
+        }
+        auto [candidate, last] = layouts.equal_range(hash);
+        for (; candidate != last && !layout; ++candidate) {
+            const std::vector<std::string> &keys = candidate->second.keys;
+            if (std::equal(keys.begin(), keys.end(), begin, members.end(),
+                           [](const std::string &key, const auto &member) { return key == member.first; })) {
+                layout = &candidate->second;
+            }
+        }
+        if (!layout) {
+            ObjectLayout created;
+            for (auto it = begin; it != members.end(); ++it) {
+                created.keys.push_back(it->first);
+            }
+            std::vector<std::string> sorted = created.keys;
+            std::sort(sorted.begin(), sorted.end());
+            if (std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end()) {
+                std::shared_ptr<const Shape> &shape = shapes[sorted];
+                if (!shape) {
+                    shape = std::make_shared<const Shape>(std::move(sorted));
+                }
+                created.shape = shape;
+                for (const std::string &key : created.keys) {
+                    created.slots.push_back(shape->find(key));
+                }
+            }
+            layout = &layouts.emplace(hash, std::move(created))->second;
+        }
+    }
+
+    AllocationScope scope(AllocationCategory::ObjectNode);
+    JsonValue result;
+    if (layout && layout->shape) {
+        std::vector<JsonValue> values(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            values[layout->slots[i]] = std::move(begin[i].second);
+        }
+        result = JsonValue::shapedObject(layout->shape, std::move(values));
+    } else {
+        // Later duplicates win, as they would with object[key] = value
+        JsonObject object;
+        for (auto it = begin; it != members.end(); ++it) {
+            object[it->first] = std::move(it->second);
+        }
+        result = JsonValue(std::move(object));
+    }
+    members.erase(begin, members.end());
+    return result;
+}
+
+// Objects keyed by ids ({"205705993": ..., "205705994": ...}) skip shapes,
+// which would never repeat, and are stored by integer key. Returns nothing
+// if a key is not numeric or occurs twice.
+std::optional<JsonValue> JsonParser::buildIntKeyedObject(std::size_t first) {
+    auto begin = members.begin() + first;
+    std::size_t count = members.size() - first;
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> order;  // Key, position in members
+    order.reserve(count);
+    bool equalLengths = true;
+    for (std::size_t i = 0; i < count; ++i) {
+        std::optional<std::uint64_t> key = numericKey(begin[i].first);
+        if (!key) {
+            return std::nullopt;
+        }
+        order.emplace_back(*key, static_cast<std::uint32_t>(i));
+        equalLengths &= begin[i].first.size() == begin->first.size();
+    }
+    std::sort(order.begin(), order.end());
+    if (std::adjacent_find(order.begin(), order.end(), [](const auto &a, const auto &b) {
+            return a.first == b.first;
+        }) != order.end()) {
+        return std::nullopt;
+    }
+
+    AllocationScope scope(AllocationCategory::ObjectNode);
+    IntKeyedObject object;
+    object.keys.reserve(count);
+    object.values.reserve(count);
+    for (const auto &[key, position] : order) {
+        object.keys.push_back(key);
+        object.values.push_back(std::move(begin[position].second));
+    }
+    if (!equalLengths) {
+        // Numeric and string order differ, "10" sorts before "9"
+        object.string_order.resize(count);
+        for (std::uint32_t i = 0; i < count; ++i) {
+            object.string_order[i] = i;
+        }
+        std::sort(object.string_order.begin(), object.string_order.end(), [&](std::uint32_t a, std::uint32_t b) {
+            return std::to_string(object.keys[a]) < std::to_string(object.keys[b]);
+        });
+    }
+    members.erase(begin, members.end());
+    return JsonValue::intKeyedObject(std::move(object));
 }
 
 
-JsonArray JsonParser::parseArray(std::istringstream &ss) {
+// Arrays are read as packed ints until the first element that is not an int,
+// which moves everything read so far into nodes
+JsonValue JsonParser::parseArray(std::istream &ss) {
+    std::vector<int> ints;
     JsonArray array;
+    bool packed = true;
     char ch;
     ss.get(ch); // Consume '['
     ss >> std::ws;
     if (ss.peek() == ']') {
         ss.get(ch); // Consume ']'
-        return array; // Empty array
+        return JsonValue(std::move(array)); // Empty array
     }
     while (true) {
         ss >> std::ws;
         JsonValue value = parseValue(ss);
-        array.push_back(value);
+        AllocationScope scope(AllocationCategory::ArrayGrowth);
+        // The ints cannot keep a null apart from 0, so nulls unpack the array
+        if (packed && value.type == JsonValue::INT && !value.isNull()) {
+            ints.push_back(value.asInt());
+        } else {
+            if (packed) {
+                packed = false;
+                array.reserve(ints.size() + 1);
+                array.assign(ints.begin(), ints.end());
+                ints = std::vector<int>();
+            }
+            array.push_back(std::move(value));
+        }
         ss >> std::ws;
         if (ss.peek() == ',') {
             ss.get(ch); // Consume ','
@@ -214,7 +870,10 @@ JsonArray JsonParser::parseArray(std::istringstream &ss) {
             throw std::runtime_error("Expected ',' or ']' in array");
         }
     }
-    return array;
+    if (packed) {
+        return JsonValue::packedArray(std::move(ints));
+    }
+    return JsonValue(std::move(array));
 }
 
 // Implementation of JsonPathEvalator methods
@@ -225,27 +884,78 @@ JsonPathEvalator::JsonPathEvalator(const JsonValue &json)
 }
 
 JsonValue JsonPathEvalator::evaluate(const std::string &expression) {
-    return evaluate(expression, jsonRoot);
+    PathMatch match = select(compile(expression));
+    if (match.multi_valued) {
+        // Only the final result is copied, the walk itself works on pointers
+        JsonArray result;
+        result.reserve(match.nodes.size());
+        for (const JsonValue *node : match.nodes) {
+            result.push_back(*node);
+        }
+        return JsonValue(result);
+    }
+    return *match.nodes.front();
 }
 
-JsonValue JsonPathEvalator::evaluate(const std::string &expression, const JsonValue& context) {
-    std::size_t pos = 0;
-    std::vector<Path> paths = parse_expression_at(expression, pos);
+namespace {
+
+// Member lookup of an Object step. In a shaped object the slot found last
+// time is tried first, so walking an array of records looks each key up
+// once per shape instead of once per record. Int-keyed objects are searched
+// with the number the step parsed its key into when it was compiled.
+const JsonValue *findMember(const Path &path, const JsonValue &node) {
+    if (const IntKeyedObject *numbered = node.intKeyed()) {
+        return path.numeric_name ? numbered->find(*path.numeric_name) : nullptr;
+    }
+    const ShapedObject *object = node.shaped();
+    if (!object) {
+        return node.find(path.name);
+    }
+    const Shape *shape = object->shape.get();
+    ShapeCache &cache = path.shape_cache;
+    std::uint32_t slot = cache.slot.load(std::memory_order_relaxed);
+    if (cache.shape.load(std::memory_order_acquire) != shape || slot >= shape->size() ||
+        shape->keys()[slot] != path.name) {
+        slot = shape->find(path.name);
+        if (slot == Shape::npos) {
+            return nullptr;
+        }
+        cache.slot.store(slot, std::memory_order_relaxed);
+        cache.shape.store(shape, std::memory_order_release);
+    }
+    return &object->values[slot];
+}
+
+} // namespace
+
+const JsonValue &JsonPathEvalator::element(const JsonValue &array, std::size_t index) {
+    const std::vector<int> *ints = array.packedInts();
+    if (!ints) {
+        return array.asArray()[index];
+    }
+    if (!elements) {
+        elements = std::make_shared<PackedElements>();
+    }
+    return elements->emplace_back((*ints)[index]);
+}
+
+const JsonValue& JsonPathEvalator::resolve(const std::vector<Path> &paths, const JsonValue& context) {
     const JsonValue* currentValue = &context;
 
     for (const auto& path : paths) {
         if (path.is_object()) {
-            if (currentValue->isObject() && currentValue->contains(path.name)) {
-                currentValue = &((*currentValue)[path.name]);
-            } else {
+            currentValue = findMember(path, *currentValue);
+            if (!currentValue) {
                 throw std::runtime_error("Invalid object path: " + path.name);
             }
         } else if (path.is_array()) {
             if (currentValue->isArray() && path.array_index < currentValue->size()) {
-                currentValue = &((*currentValue)[path.array_index]);
+                currentValue = &element(*currentValue, path.array_index);
             } else {
                 throw std::runtime_error("Invalid array index: " + std::to_string(path.array_index));
             }
+        } else if (path.is_dynamic()) {
+            currentValue = resolve_dynamic(path, *currentValue, true);
         } else {
             throw std::runtime_error("Invalid path type");
         }
@@ -253,6 +963,212 @@ JsonValue JsonPathEvalator::evaluate(const std::string &expression, const JsonVa
     return *currentValue;
 }
 
+// Looks up the index or key a Dynamic step computes from the root. Returns
+// nullptr for a missing element unless `strict`, in which case it throws.
+const JsonValue* JsonPathEvalator::resolve_dynamic(const Path &path, const JsonValue &node, bool strict) {
+    const JsonValue &index = resolve(path.index_path, jsonRoot);
+    if (index.type == JsonValue::INT) {
+        std::size_t arrayIndex = index.asInt();
+        if (node.isArray() && arrayIndex < node.size()) {
+            return &element(node, arrayIndex);
+        }
+        if (strict) {
+            throw std::runtime_error("Invalid array index: " + std::to_string(arrayIndex));
+        }
+    } else if (index.type == JsonValue::STRING) {
+        if (const JsonValue *member = node.find(index.asString())) {
+            return member;
+        }
+        if (strict) {
+            throw std::runtime_error("Invalid object path: " + std::string(index.asString()));
+        }
+    } else {
+        throw std::runtime_error("Invalid index type in array access");
+    }
+    return nullptr;
+}
+
+PathMatch JsonPathEvalator::select(const std::string &expression) {
+    return select(compile(expression));
+}
+
+PathMatch JsonPathEvalator::select(const std::vector<Path> &paths, bool lenient) {
+    PathMatch match;
+    match.multi_valued = std::any_of(paths.begin(), paths.end(), [](const Path &path) { return path.is_multi_valued(); });
+    elements.reset();
+    if (match.multi_valued || lenient) {
+        collect(paths, 0, jsonRoot, match.nodes);
+    } else {
+        match.nodes.push_back(&resolve(paths, jsonRoot));
+    }
+    match.elements = std::move(elements);
+    return match;
+}
+
+std::vector<Path> JsonPathEvalator::compile(const std::string &expression) {
+    std::size_t pos = 0;
+    return parse_expression_at(expression, pos);
+}
+
+// Exactly one wildcard, every other step a plain key or index
+bool JsonPathEvalator::is_projectable(const std::vector<Path> &paths) {
+    auto plain = [](const Path &path) { return path.is_object() || path.is_array(); };
+    auto wildcard = std::find_if_not(paths.begin(), paths.end(), plain);
+    return wildcard != paths.end() && wildcard->is_wildcard() && std::all_of(wildcard + 1, paths.end(), plain);
+}
+
+std::unique_ptr<IntColumn> JsonPathEvalator::project(const std::vector<Path> &paths) {
+    if (!is_projectable(paths)) {
+        return nullptr;
+    }
+    auto wildcard = std::find_if(paths.begin(), paths.end(), [](const Path &path) { return path.is_wildcard(); });
+    std::size_t step = wildcard - paths.begin();
+
+    NodeList prefix;
+    collect(std::vector<Path>(paths.begin(), wildcard), 0, jsonRoot, prefix);
+    if (prefix.empty() || !prefix.front()->isArray()) {
+        return nullptr;
+    }
+
+    auto column = std::make_unique<IntColumn>();
+    if (const std::vector<int> *ints = prefix.front()->packedInts()) {
+        // Ints have no fields, only `array[*]` itself matches them
+        bool whole = step + 1 == paths.size();
+        column->values.reserve(ints->size());
+        column->validity.reserve((ints->size() + 63) / 64);
+        for (int value : *ints) {
+            column->append(whole ? &value : nullptr);
+        }
+        return column;
+    }
+    const JsonArray &rows = prefix.front()->asArray();
+    column->values.reserve(rows.size());
+    column->validity.reserve((rows.size() + 63) / 64);
+    NodeList field;
+    for (const JsonValue &row : rows) {
+        field.clear();
+        collect(paths, step + 1, row, field);
+        if (field.empty()) {
+            column->append(nullptr);
+        } else if (field.front()->type == JsonValue::INT) {
+            int value = field.front()->asInt();
+            column->append(&value);
+        } else {
+            return nullptr;
+        }
+    }
+    return column;
+}
+
+// Walks the remaining steps depth first, appending every node the full path
+// matches to `out` in document order. Steps that do not apply to a node
+// (missing key, index out of range, wrong type) simply drop it.
+void JsonPathEvalator::collect(const std::vector<Path> &paths, std::size_t step, const JsonValue &node, NodeList &out) {
+    if (step == paths.size()) {
+        out.push_back(&node);
+        return;
+    }
+
+    const Path &path = paths[step];
+    if (path.is_object()) {
+        if (const JsonValue *member = findMember(path, node)) {
+            collect(paths, step + 1, *member, out);
+        }
+    } else if (path.is_array()) {
+        if (node.isArray() && path.array_index < node.size()) {
+            collect(paths, step + 1, element(node, path.array_index), out);
+        }
+    } else if (path.is_dynamic()) {
+        if (const JsonValue *element = resolve_dynamic(path, node, false)) {
+            collect(paths, step + 1, *element, out);
+        }
+    } else if (path.is_wildcard()) {
+        if (node.isArray()) {
+            for (std::size_t i = 0; i < node.size(); ++i) {
+                collect(paths, step + 1, element(node, i), out);
+            }
+        } else {
+            node.forEachMember([&](std::string_view, const JsonValue &member) {
+                collect(paths, step + 1, member, out);
+            });
+        }
+    } else if (path.is_slice()) {
+        if (!node.isArray()) {
+            return;
+        }
+        long length = static_cast<long>(node.size());
+        auto clamp = [length](long index) {
+            if (index < 0) {
+                index += length;
+            }
+            return std::clamp(index, 0L, length);
+        };
+        long begin = path.slice_start ? clamp(*path.slice_start) : 0;
+        long end = path.slice_end ? clamp(*path.slice_end) : length;
+        for (long i = begin; i < end; i += path.slice_step) {
+            collect(paths, step + 1, element(node, i), out);
+        }
+    } else if (path.is_descendant()) {
+        // The node itself, then all of its descendants in document order.
+        // Ints have no members, so `..name` need not expand packed arrays.
+        collect(paths, step + 1, node, out);
+        bool intsCannotMatch = step + 1 < paths.size() && (paths[step + 1].is_object() || paths[step + 1].is_array());
+        if (node.packedInts() && intsCannotMatch) {
+            return;
+        }
+        if (node.isArray()) {
+            for (std::size_t i = 0; i < node.size(); ++i) {
+                collect(paths, step, element(node, i), out);
+            }
+        } else {
+            node.forEachMember([&](std::string_view, const JsonValue &member) {
+                collect(paths, step, member, out);
+            });
+        }
+    } else if (path.is_filter()) {
+        NodeList candidates;
+        if (node.isArray()) {
+            candidates.reserve(node.size());
+            for (std::size_t i = 0; i < node.size(); ++i) {
+                candidates.push_back(&element(node, i));
+            }
+        } else {
+            node.forEachMember([&candidates](std::string_view, const JsonValue &member) {
+                candidates.push_back(&member);
+            });
+        }
+        collect_filtered(paths, step, candidates, out);
+    } else {
+        throw std::runtime_error("Invalid path type");
+    }
+}
+
+// Tests the predicate of a Filter step on every candidate, in parallel chunks
+// for large arrays, then continues the walk with the survivors in their
+// original order.
+void JsonPathEvalator::collect_filtered(const std::vector<Path> &paths, std::size_t step, const NodeList &candidates, NodeList &out) {
+    const ExpressionNode &predicate = *paths[step].predicate;
+    std::vector<char> keep(candidates.size());
+    auto test = [&](std::size_t begin, std::size_t end) {
+        TraceSpan span("filter chunk");
+        for (std::size_t i = begin; i < end; ++i) {
+            keep[i] = ExpressionEvaluator::matchesFilter(predicate, *candidates[i], jsonRoot);
+        }
+    };
+
+    if (candidates.size() >= ParallelFilterThreshold) {
+        ThreadPool::shared().parallel_for(candidates.size(), ParallelFilterThreshold / 2, test);
+    } else {
+        test(0, candidates.size());
+    }
+
+    for (std::size_t i = 0; i < candidates.size(); ++i) {
+        if (keep[i]) {
+            collect(paths, step + 1, *candidates[i], out);
+        }
+    }
+}
+
 std::vector<Path> JsonPathEvalator::parse_expression_at(const std::string &expression, std::size_t &pos) {
     std::vector<Path> paths;
     while (pos < expression.length()) {
@@ -264,23 +1180,40 @@ std::vector<Path> JsonPathEvalator::parse_expression_at(const std::string &expre
             }
             std::string key = expression.substr(start, pos - start);
             paths.emplace_back(Path::Object, key);
+        } else if (expression[pos] == '*') {
+            ++pos; // Consume '*' of a `.*` wildcard
+            paths.emplace_back(Path::Wildcard, "");
         } else if (expression[pos] == '[') {
             ++pos; // Consume '['
-            // Parse the content inside brackets
-            JsonValue indexValue = parse_bracket_expression(expression, pos);
+            if (expression[pos] == '*') {
+                ++pos; // Consume '*'
+                paths.emplace_back(Path::Wildcard, "");
+            } else if (expression[pos] == '?') {
+                ++pos; // Consume '?', the predicate itself is in parentheses
+                paths.emplace_back(ExpressionEvaluator::compileFilter(expression, pos));
+            } else {
+                // A ':' right after an optional integer makes this a slice
+                std::size_t end = pos;
+                while (end < expression.length() && (std::isdigit(expression[end]) || expression[end] == '-')) {
+                    ++end;
+                }
+                if (expression[end] == ':') {
+                    paths.push_back(parse_slice(expression, pos));
+                } else {
+                    // Parse the content inside brackets
+                    paths.push_back(parse_bracket_expression(expression, pos));
+                }
+            }
             if (expression[pos] != ']') {
                 throw std::runtime_error("Expected ']' in expression");
             }
             ++pos; // Consume ']'
-            if (indexValue.type == JsonValue::INT) {
-                paths.emplace_back(Path::Array, "", std::get<int>(indexValue.value));
-            } else if (indexValue.type == JsonValue::STRING) {
-                paths.emplace_back(Path::Object, std::get<std::string>(indexValue.value));
-            } else {
-                throw std::runtime_error("Invalid index type in array access");
-            }
         } else if (expression[pos] == '.') {
             ++pos; // Consume '.'
+            if (pos < expression.length() && expression[pos] == '.') {
+                ++pos; // Consume second '.' of recursive descent
+                paths.emplace_back(Path::Descendant, "");
+            }
         } else {
             throw std::runtime_error("Invalid character in expression: " + std::string(1, expression[pos]));
         }
@@ -288,11 +1221,10 @@ std::vector<Path> JsonPathEvalator::parse_expression_at(const std::string &expre
     return paths;
 }
 
-JsonValue JsonPathEvalator::parse_bracket_expression(const std::string &expression, std::size_t &pos) {
+Path JsonPathEvalator::parse_bracket_expression(const std::string &expression, std::size_t &pos) {
     if (expression[pos] == '"') {
         // Parse string
-        std::string strValue = parseStringInExpression(expression, pos);
-        return JsonValue(strValue);
+        return Path(Path::Object, parseStringInExpression(expression, pos));
     } else if (std::isdigit(expression[pos]) || expression[pos] == '-') {
         // Parse number
         std::size_t start = pos;
@@ -300,7 +1232,7 @@ JsonValue JsonPathEvalator::parse_bracket_expression(const std::string &expressi
             ++pos;
         }
         int intValue = std::stoi(expression.substr(start, pos - start));
-        return JsonValue(intValue);
+        return Path(Path::Array, "", intValue);
     } else {
         // Parse nested expression
         std::size_t start = pos;
@@ -320,10 +1252,36 @@ JsonValue JsonPathEvalator::parse_bracket_expression(const std::string &expressi
             throw std::runtime_error("Mismatched brackets in expression");
         }
         std::string nestedExpression = expression.substr(start, pos - start);
-        // Evaluate nested expression with root context
-        JsonValue indexValue = evaluate(nestedExpression, jsonRoot);
-        return indexValue;
+        // Evaluated against the root each time the path is selected
+        return Path(compile(nestedExpression));
+    }
+}
+
+Path JsonPathEvalator::parse_slice(const std::string &expression, std::size_t &pos) {
+    // Parses `start:end` or `start:end:step`, every part is optional
+    auto parseBound = [&]() -> std::optional<long> {
+        std::size_t start = pos;
+        while (pos < expression.length() && (std::isdigit(expression[pos]) || expression[pos] == '-')) {
+            ++pos;
+        }
+        if (start == pos) {
+            return std::nullopt;
+        }
+        return std::stol(expression.substr(start, pos - start));
+    };
+
+    std::optional<long> start = parseBound();
+    ++pos; // Consume ':'
+    std::optional<long> end = parseBound();
+    long step = 1;
+    if (expression[pos] == ':') {
+        ++pos; // Consume ':'
+        step = parseBound().value_or(1);
+        if (step <= 0) {
+            throw std::runtime_error("Slice step must be positive");
+        }
     }
+    return Path(start, end, step);
 }
 
 std::string JsonPathEvalator::parseStringInExpression(const std::string &expression, std::size_t &pos) {
@@ -381,54 +1339,218 @@ std::string JsonPathEvalator::parseStringInExpression(const std::string &express
 
 // Implementation of JsonStorage methods
 
-JsonStorage::JsonStorage(const std::string &jsonFileContent) {
-    JsonParser parser;
-    json_content = parser.parse(jsonFileContent);
+JsonStorage::JsonStorage(const std::string &jsonFileContent, ParseOptions options) {
+    TraceSpan span("parse document");
+    auto start = std::chrono::steady_clock::now();
+    AllocationCounters allocations = allocationCounters();
+    CategoryAllocations byCategory = allocationsByCategory();
+    JsonParser parser(options);
+    auto document = std::make_shared<JsonValue>(parser.parse(jsonFileContent));
+    writable_content = document.get();
+    json_content = std::move(document);
+    parse_stats.parse_time =
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    parse_stats.input_bytes = jsonFileContent.size();
+    parse_stats.nodes = parser.node_counts();
+    parse_stats.subtrees = parser.subtrees_parsed();
+    parse_stats.distinct_subtrees = parser.subtrees_stored();
+    parse_stats.allocations = allocationCounters() - allocations;
+    parse_stats.allocations_by_category = allocationsByCategory() - byCategory;
+    source = parser.take_source();
+    spans = parser.take_spans();
+}
+
+JsonStorage::JsonStorage(std::istream &jsonInput, ParseOptions options) {
+    TraceSpan span("parse document");
+    auto start = std::chrono::steady_clock::now();
+    AllocationCounters allocations = allocationCounters();
+    CategoryAllocations byCategory = allocationsByCategory();
+    // gzip and zstd input is decompressed block by block on the way in
+    DecompressingStreamBuf decoder(*jsonInput.rdbuf());
+    std::istream input(&decoder);
+    JsonParser parser(options);
+    auto document = std::make_shared<JsonValue>(parser.parse(input));
+    writable_content = document.get();
+    json_content = std::move(document);
+    parse_stats.parse_time =
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    parse_stats.input_bytes = decoder.bytes_read();
+    parse_stats.nodes = parser.node_counts();
+    parse_stats.subtrees = parser.subtrees_parsed();
+    parse_stats.distinct_subtrees = parser.subtrees_stored();
+    parse_stats.allocations = allocationCounters() - allocations;
+    parse_stats.allocations_by_category = allocationsByCategory() - byCategory;
+    source = parser.take_source();
+    spans = parser.take_spans();
+}
+
+std::string_view JsonStorage::source_text(const JsonValue& value) const {
+    const void *block = value.block();
+    auto it = block ? spans.find(block) : spans.end();
+    if (it == spans.end()) {
+        return {};
+    }
+    return std::string_view(source).substr(it->second.offset, it->second.length);
+}
+
+JsonStorage::JsonStorage(std::shared_ptr<const JsonValue> document)
+    : json_content(std::move(document))
+{
 }
 
 JsonValue JsonStorage::get(const std::string& path) {
-    JsonPathEvalator evaluator(json_content);
-    return evaluator.evaluate(path);
+    PathMatch match = select(path);
+    if (match.multi_valued) {
+        JsonArray result;
+        result.reserve(match.nodes.size());
+        for (const JsonValue *node : match.nodes) {
+            result.push_back(*node);
+        }
+        return JsonValue(result);
+    }
+    return *match.nodes.front();
+}
+
+PathMatch JsonStorage::select(const std::string& path) {
+    // Probe before compiling, a hit skips parsing the path as well
+    if (path_index) {
+        if (const JsonValue *node = path_index->find(path)) {
+            return PathMatch{{node}, false, nullptr};
+        }
+    }
+    return select_and_remember(path, JsonPathEvalator::compile(path));
+}
+
+PathMatch JsonStorage::select(const std::string& path, const std::vector<Path>& steps) {
+    if (path_index) {
+        if (const JsonValue *node = path_index->find(path)) {
+            return PathMatch{{node}, false, nullptr};
+        }
+    }
+    return select_and_remember(path, steps);
+}
+
+PathMatch JsonStorage::select_and_remember(const std::string& path, const std::vector<Path>& steps) {
+    JsonPathEvalator evaluator(*json_content);
+    PathMatch match = evaluator.select(steps);
+    // A packed-array element has no node the index could point to
+    if (path_index && !match.multi_valued && !match.elements) {
+        path_index->insert(path, match.nodes.front());
+    }
+    return match;
+}
+
+const PathIndex& JsonStorage::build_index(std::size_t budgetBytes) {
+    path_index = std::make_unique<PathIndex>(budgetBytes);
+    path_index->build(*json_content);
+    return *path_index;
+}
+
+void JsonStorage::enable_index(std::size_t budgetBytes) {
+    path_index = std::make_unique<PathIndex>(budgetBytes);
+}
+
+PathMatch JsonStorage::select(const std::vector<Path>& paths) {
+    JsonPathEvalator evaluator(*json_content);
+    return evaluator.select(paths);
+}
+
+const IntColumn* JsonStorage::column(const std::string& path) {
+    return column(path, JsonPathEvalator::compile(path));
+}
+
+// Only columns that were built are kept, a path that cannot be projected is
+// tried again on the next call
+const IntColumn* JsonStorage::column(const std::string& path, const std::vector<Path>& steps) {
+    auto it = columns.find(path);
+    if (it == columns.end()) {
+        JsonPathEvalator evaluator(*json_content);
+        std::unique_ptr<IntColumn> projected = evaluator.project(steps);
+        if (!projected) {
+            return nullptr;
+        }
+        it = columns.emplace(path, std::move(projected)).first;
+    }
+    return it->second.get();
 }
 
 // Function to print JsonValue
 
 void printJsonValue(const JsonValue &value) {
+    printJsonValue(value, std::cout);
+}
+
+namespace {
+
+// Writes `value` with printMember(member) writing each member or element
+template <typename PrintMember>
+void printValue(const JsonValue &value, std::ostream &out, PrintMember &&printMember) {
     switch (value.type) {
         case JsonValue::INT:
-            std::cout << std::get<int>(value.value);
+            if (value.isNull()) {
+                out << "null";
+            } else {
+                out << value.asInt();
+            }
             break;
         case JsonValue::STRING:
-            std::cout << '"' << std::get<std::string>(value.value) << '"';
+            out << '"' << value.asString() << '"';
             break;
         case JsonValue::OBJECT: {
-            std::cout << "{";
-            const JsonObject &obj = std::get<JsonObject>(value.value);
+            out << "{";
             bool first = true;
-            for (const auto& [key, val] : obj) {
+            value.forEachMember([&](std::string_view key, const JsonValue &member) {
                 if (!first) {
-                    std::cout << ", ";
+                    out << ", ";
                 }
-                std::cout << '"' << key << "\": ";
-                printJsonValue(val);
+                out << '"' << key << "\": ";
+                printMember(member);
                 first = false;
-            }
-            std::cout << "}";
+            });
+            out << "}";
             break;
         }
         case JsonValue::ARRAY: {
-            std::cout << "[";
-            const JsonArray &arr = std::get<JsonArray>(value.value);
+            out << "[";
+            if (const std::vector<int> *ints = value.packedInts()) {
+                for (std::size_t i = 0; i < ints->size(); ++i) {
+                    out << (i > 0 ? ", " : "") << (*ints)[i];
+                }
+                out << "]";
+                break;
+            }
+            const JsonArray &arr = value.asArray();
             for (std::size_t i = 0; i < arr.size(); ++i) {
                 if (i > 0) {
-                    std::cout << ", ";
+                    out << ", ";
                 }
-                printJsonValue(arr[i]);
+                printMember(arr[i]);
             }
-            std::cout << "]";
+            out << "]";
             break;
         }
         default:
             break;
     }
 }
+
+} // namespace
+
+void printJsonValue(const JsonValue &value, std::ostream &out) {
+    printValue(value, out, [&out](const JsonValue &member) { printJsonValue(member, out); });
+}
+
+void printJsonSource(const JsonValue &value, const JsonStorage &storage, std::ostream &out, bool minify) {
+    std::string_view text = storage.source_text(value);
+    if (text.empty()) {
+        printValue(value, out, [&](const JsonValue &member) { printJsonSource(member, storage, out, minify); });
+        return;
+    }
+    if (!minify) {
+        out.write(text.data(), static_cast<std::streamsize>(text.size()));
+        return;
+    }
+    std::string stripped(text.size(), '\0');
+    stripped.resize(minifyJson(text, stripped.data()));
+    out << stripped;
+}
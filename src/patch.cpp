@@ -0,0 +1,378 @@
+#include "parser.h"
+#include <utility>
+
+JsonPointer parseJsonPointer(const std::string &pointer) {
+    JsonPointer tokens;
+    if (pointer.empty()) {
+        return tokens;
+    }
+    if (pointer[0] != '/') {
+        throw std::runtime_error("JSON pointer must start with '/': " + pointer);
+    }
+    std::string token;
+    for (std::size_t i = 1; i <= pointer.size(); ++i) {
+        if (i == pointer.size() || pointer[i] == '/') {
+            tokens.push_back(std::move(token));
+            token.clear();
+        } else if (pointer[i] == '~') {
+            // ~0 is '~' and ~1 is '/'
+            char next = i + 1 < pointer.size() ? pointer[i + 1] : '\0';
+            if (next != '0' && next != '1') {
+                throw std::runtime_error("Invalid escape in JSON pointer: " + pointer);
+            }
+            token += next == '0' ? '~' : '/';
+            ++i;
+        } else {
+            token += pointer[i];
+        }
+    }
+    return tokens;
+}
+
+bool pointersOverlap(const JsonPointer &a, const JsonPointer &b) {
+    std::size_t length = std::min(a.size(), b.size());
+    return std::equal(a.begin(), a.begin() + length, b.begin());
+}
+
+namespace {
+
+std::string pointerString(const JsonPointer &pointer) {
+    std::string result;
+    for (const std::string &token : pointer) {
+        result += '/';
+        for (char c : token) {
+            result += c == '~' ? "~0" : c == '/' ? "~1" : std::string(1, c);
+        }
+    }
+    return result;
+}
+
+// "-" is the position after the last element, only valid where inserting
+std::size_t arrayIndex(const JsonPointer &pointer, std::size_t depth, std::size_t size, bool allowEnd) {
+    const std::string &token = pointer[depth];
+    if (allowEnd && token == "-") {
+        return size;
+    }
+    bool valid = !token.empty() && token.size() <= 9 && std::all_of(token.begin(), token.end(), ::isdigit) &&
+                 (token.size() == 1 || token[0] != '0');
+    if (!valid) {
+        throw std::runtime_error("Invalid array index in JSON pointer: " + pointerString(pointer));
+    }
+    std::size_t index = std::stoul(token);
+    if (index > size || (!allowEnd && index == size)) {
+        throw std::runtime_error("Array index out of range in JSON pointer: " + pointerString(pointer));
+    }
+    return index;
+}
+
+// Node at the first `length` tokens of pointer
+JsonValue &locate(JsonValue &root, const JsonPointer &pointer, std::size_t length) {
+    JsonValue *node = &root;
+    for (std::size_t depth = 0; depth < length; ++depth) {
+        if (node->isObject()) {
+            JsonObject &obj = node->asObject();
+            auto it = obj.find(pointer[depth]);
+            if (it == obj.end()) {
+                throw std::runtime_error("Path not found: " + pointerString(pointer));
+            }
+            node = &it->second;
+        } else if (node->isArray()) {
+            JsonArray &arr = node->asArray();
+            node = &arr[arrayIndex(pointer, depth, arr.size(), false)];
+        } else {
+            throw std::runtime_error("Path not found: " + pointerString(pointer));
+        }
+    }
+    return *node;
+}
+
+// Copy of the node at pointer, for the operations that only read. Unlike
+// locate it leaves shared blocks and shaped, int-keyed or packed containers
+// along the way as they are; the copy of a container shares its block.
+JsonValue valueAt(const JsonValue &root, const JsonPointer &pointer) {
+    const JsonValue *node = &root;
+    for (std::size_t depth = 0; depth < pointer.size(); ++depth) {
+        if (node->isObject()) {
+            node = node->find(pointer[depth]);
+            if (!node) {
+                throw std::runtime_error("Path not found: " + pointerString(pointer));
+            }
+        } else if (const std::vector<int> *ints = node->packedInts()) {
+            std::size_t index = arrayIndex(pointer, depth, ints->size(), false);
+            if (depth + 1 < pointer.size()) {
+                throw std::runtime_error("Path not found: " + pointerString(pointer));
+            }
+            return JsonValue((*ints)[index]);
+        } else if (node->isArray()) {
+            const JsonArray &arr = node->asArray();
+            node = &arr[arrayIndex(pointer, depth, arr.size(), false)];
+        } else {
+            throw std::runtime_error("Path not found: " + pointerString(pointer));
+        }
+    }
+    return *node;
+}
+
+// Applies the operations of one patch and records how to revert each of them.
+// Undo steps store pointers rather than references, since inserting into an
+// array may move everything below it.
+class PatchTransaction {
+public:
+    explicit PatchTransaction(JsonValue &document) : root(document) {}
+
+    // RFC 6902 "add": inserts into arrays, sets object members. Returns the
+    // location whose value changed, the whole array for array insertions.
+    JsonPointer add(const JsonPointer &pointer, JsonValue value) {
+        if (pointer.empty()) {
+            return replace(pointer, std::move(value));
+        }
+        JsonPointer parentPointer(pointer.begin(), pointer.end() - 1);
+        JsonValue &parent = locate(root, pointer, parentPointer.size());
+        if (parent.isObject()) {
+            JsonObject &obj = parent.asObject();
+            auto [it, inserted] = obj.try_emplace(pointer.back());
+            JsonValue previous = std::exchange(it->second, std::move(value));
+            undo.push_back({inserted ? Undo::Remove : Undo::Restore, pointer, std::move(previous)});
+            return pointer;
+        }
+        if (parent.isArray()) {
+            JsonArray &arr = parent.asArray();
+            std::size_t index = arrayIndex(pointer, pointer.size() - 1, arr.size(), true);
+            arr.insert(arr.begin() + index, std::move(value));
+            JsonPointer inserted = parentPointer;
+            inserted.push_back(std::to_string(index));
+            undo.push_back({Undo::Remove, std::move(inserted), JsonValue()});
+            return parentPointer;
+        }
+        throw std::runtime_error("Path not found: " + pointerString(pointer));
+    }
+
+    // Returns the removed value and stores the location that changed in `touched`
+    JsonValue remove(const JsonPointer &pointer, JsonPointer &touched) {
+        if (pointer.empty()) {
+            throw std::runtime_error("Cannot remove the document root");
+        }
+        JsonPointer parentPointer(pointer.begin(), pointer.end() - 1);
+        JsonValue &parent = locate(root, pointer, parentPointer.size());
+        JsonValue removed;
+        if (parent.isObject()) {
+            JsonObject &obj = parent.asObject();
+            auto it = obj.find(pointer.back());
+            if (it == obj.end()) {
+                throw std::runtime_error("Path not found: " + pointerString(pointer));
+            }
+            removed = std::move(it->second);
+            obj.erase(it);
+            touched = pointer;
+        } else if (parent.isArray()) {
+            JsonArray &arr = parent.asArray();
+            std::size_t index = arrayIndex(pointer, pointer.size() - 1, arr.size(), false);
+            removed = std::move(arr[index]);
+            arr.erase(arr.begin() + index);
+            touched = parentPointer;
+        } else {
+            throw std::runtime_error("Path not found: " + pointerString(pointer));
+        }
+        undo.push_back({Undo::Insert, pointer, removed});
+        return removed;
+    }
+
+    JsonPointer replace(const JsonPointer &pointer, JsonValue value) {
+        JsonValue &target = locate(root, pointer, pointer.size());
+        undo.push_back({Undo::Restore, pointer, std::exchange(target, std::move(value))});
+        return pointer;
+    }
+
+    void rollback() {
+        for (auto it = undo.rbegin(); it != undo.rend(); ++it) {
+            const JsonPointer &pointer = it->pointer;
+            if (it->action == Undo::Restore) {
+                locate(root, pointer, pointer.size()) = std::move(it->value);
+                continue;
+            }
+            JsonValue &parent = locate(root, pointer, pointer.size() - 1);
+            if (parent.isObject()) {
+                JsonObject &obj = parent.asObject();
+                if (it->action == Undo::Remove) {
+                    obj.erase(pointer.back());
+                } else {
+                    obj.emplace(pointer.back(), std::move(it->value));
+                }
+            } else {
+                JsonArray &arr = parent.asArray();
+                std::size_t index = std::stoul(pointer.back());
+                if (it->action == Undo::Remove) {
+                    arr.erase(arr.begin() + index);
+                } else {
+                    arr.insert(arr.begin() + index, std::move(it->value));
+                }
+            }
+        }
+        undo.clear();
+    }
+
+private:
+    struct Undo {
+        enum Action { Remove, Insert, Restore } action;
+        JsonPointer pointer;
+        JsonValue value;  // Value to insert or restore
+    };
+
+    JsonValue &root;
+    std::vector<Undo> undo;
+};
+
+const JsonValue &member(const JsonValue &operation, const std::string &name) {
+    if (!operation.contains(name)) {
+        throw std::runtime_error("Patch operation is missing \"" + name + "\"");
+    }
+    return operation[name];
+}
+
+std::string stringMember(const JsonValue &operation, const std::string &name) {
+    const JsonValue &value = member(operation, name);
+    if (value.type != JsonValue::STRING) {
+        throw std::runtime_error("Patch operation member \"" + name + "\" must be a string");
+    }
+    return std::string(value.asString());
+}
+
+bool isTest(const JsonValue &operation) {
+    const JsonValue *op = operation.find("op");
+    return op && op->type == JsonValue::STRING && op->asString() == "test";
+}
+
+void testOperation(const JsonValue &root, const JsonValue &operation) {
+    JsonPointer path = parseJsonPointer(stringMember(operation, "path"));
+    if (!(valueAt(root, path) == member(operation, "value"))) {
+        throw std::runtime_error("Patch test failed at " + pointerString(path));
+    }
+}
+
+void applyOperation(PatchTransaction &transaction, const JsonValue &root, const JsonValue &operation,
+                    std::vector<JsonPointer> &touched) {
+    if (!operation.isObject()) {
+        throw std::runtime_error("Patch operation must be an object");
+    }
+    std::string op = stringMember(operation, "op");
+    JsonPointer path = parseJsonPointer(stringMember(operation, "path"));
+
+    if (op == "add") {
+        touched.push_back(transaction.add(path, member(operation, "value")));
+    } else if (op == "remove") {
+        touched.emplace_back();
+        transaction.remove(path, touched.back());
+    } else if (op == "replace") {
+        touched.push_back(transaction.replace(path, member(operation, "value")));
+    } else if (op == "move" || op == "copy") {
+        JsonPointer from = parseJsonPointer(stringMember(operation, "from"));
+        JsonValue value;
+        if (op == "move") {
+            if (from.size() < path.size() && pointersOverlap(from, path)) {
+                throw std::runtime_error("Cannot move a value into itself: " + pointerString(path));
+            }
+            touched.emplace_back();
+            value = transaction.remove(from, touched.back());
+        } else {
+            value = valueAt(root, from);
+        }
+        touched.push_back(transaction.add(path, std::move(value)));
+    } else if (op == "test") {
+        testOperation(root, operation);
+    } else {
+        throw std::runtime_error("Unknown patch operation: " + op);
+    }
+}
+
+// Objects in the patch are merged member by member, anything else replaces
+// the target. A null member removes the member of the target.
+void mergeInto(JsonValue &target, const JsonValue &patch, JsonPointer &pointer, std::vector<JsonPointer> &touched) {
+    if (!patch.isObject()) {
+        target = patch;
+        touched.push_back(pointer);
+        return;
+    }
+    if (!target.isObject()) {
+        target = JsonValue(JsonObject());
+        touched.push_back(pointer);
+    }
+    JsonObject &obj = target.asObject();
+    patch.forEachMember([&](std::string_view key, const JsonValue &value) {
+        pointer.emplace_back(key);
+        if (!value.isNull()) {
+            mergeInto(obj[pointer.back()], value, pointer, touched);
+        } else if (obj.erase(pointer.back())) {
+            touched.push_back(pointer);
+        }
+        pointer.pop_back();
+    });
+}
+
+} // namespace
+
+std::vector<JsonPointer> JsonStorage::apply_patch(const std::string& patch) {
+    JsonParser parser;
+    JsonValue operations = parser.parse(patch);
+    if (!operations.isArray()) {
+        throw std::runtime_error("JSON patch must be an array of operations");
+    }
+
+    // A patch that only tests needs no private copy and keeps the caches
+    const JsonArray &list = operations.asArray();
+    if (std::all_of(list.begin(), list.end(), isTest)) {
+        for (const JsonValue &operation : list) {
+            testOperation(*json_content, operation);
+        }
+        return {};
+    }
+
+    JsonValue &document = mutable_document();
+    PatchTransaction transaction(document);
+    std::vector<JsonPointer> touched;
+    try {
+        for (const JsonValue &operation : list) {
+            applyOperation(transaction, document, operation, touched);
+        }
+    } catch (...) {
+        transaction.rollback();
+        invalidate_caches();  // Array elements may have moved even when reverted
+        throw;
+    }
+    invalidate_caches();
+    return touched;
+}
+
+std::vector<JsonPointer> JsonStorage::merge_patch(const std::string& patch) {
+    JsonParser parser;
+    JsonValue changes = parser.parse(patch);
+    std::vector<JsonPointer> touched;
+    JsonPointer pointer;
+    mergeInto(mutable_document(), changes, pointer, touched);
+    invalidate_caches();
+    return touched;
+}
+
+// Only a document this storage created itself is written in place, and only
+// while nobody else can see it. One handed to the constructor may really be
+// const, and snapshots still held elsewhere keep the old version, so both
+// get a private copy first; copies share the tree until it is changed.
+JsonValue& JsonStorage::mutable_document() {
+    if (!writable_content || json_content.use_count() > 1) {
+        auto copy = std::make_shared<JsonValue>(*json_content);
+        writable_content = copy.get();
+        json_content = std::move(copy);
+        invalidate_caches();
+    }
+    return *writable_content;
+}
+
+void JsonStorage::invalidate_caches() {
+    columns.clear();
+    if (path_index) {
+        path_index->clear();
+    }
+    // Changed containers no longer match their text, and freed blocks may be
+    // reused by new ones
+    spans.clear();
+    std::string().swap(source);
+}
@@ -0,0 +1,96 @@
+#include "path_index.h"
+#include "parser.h"
+#include <deque>
+#include <utility>
+
+PathIndex::PathIndex(std::size_t budgetBytes) {
+    info.budget = budgetBytes;
+}
+
+// Hash node plus its bucket slot and the key characters; short keys live in
+// the string itself, which is already counted in the node.
+std::size_t PathIndex::entryBytes(const std::string &path) {
+    std::size_t node = sizeof(std::pair<const std::string, const JsonValue *>) + 2 * sizeof(void *);
+    return node + sizeof(void *) + (path.size() >= sizeof(std::string) ? path.size() + 1 : 0);
+}
+
+const JsonValue *PathIndex::find(const std::string &path) const {
+    auto it = entries.find(path);
+    return it != entries.end() ? it->second : nullptr;
+}
+
+bool PathIndex::insert(const std::string &path, const JsonValue *node) {
+    std::size_t bytes = entryBytes(path);
+    if (info.bytes + bytes > info.budget) {
+        return false;
+    }
+    if (entries.emplace(path, node).second) {
+        info.entries++;
+        info.bytes += bytes;
+    }
+    return true;
+}
+
+void PathIndex::clear() {
+    entries.clear();
+    info = Stats{0, 0, info.budget};
+}
+
+// Keys in the form the path parser reads back: identifiers after a dot,
+// anything else as an escaped bracket string
+static std::string childPath(const std::string &parent, std::string_view key) {
+    bool identifier = !key.empty() && (std::isalpha(static_cast<unsigned char>(key[0])) || key[0] == '_') &&
+                      std::all_of(key.begin(), key.end(), [](char c) {
+                          return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+                      });
+    if (identifier) {
+        return parent.empty() ? std::string(key) : parent + "." + std::string(key);
+    }
+    std::string path = parent + "[\"";
+    for (char c : key) {
+        if (c == '"' || c == '\\') {
+            path += '\\';
+        }
+        path += c;
+    }
+    return path + "\"]";
+}
+
+void PathIndex::build(const JsonValue &root) {
+    auto start = std::chrono::steady_clock::now();
+    clear();
+
+    std::deque<std::pair<std::string, const JsonValue *>> pending;
+    pending.emplace_back("", &root);
+    bool complete = true;
+    while (!pending.empty() && complete) {
+        auto [path, node] = std::move(pending.front());
+        pending.pop_front();
+        if (node->isObject()) {
+            node->forEachMember([&](std::string_view key, const JsonValue &member) {
+                if (!complete) {
+                    return;
+                }
+                std::string memberPath = childPath(path, key);
+                if (!insert(memberPath, &member)) {
+                    complete = false;
+                    return;
+                }
+                pending.emplace_back(std::move(memberPath), &member);
+            });
+        } else if (node->isArray()) {
+            const JsonArray &arr = node->asArray();
+            for (std::size_t i = 0; i < arr.size(); ++i) {
+                std::string elementPath = path + "[" + std::to_string(i) + "]";
+                if (!insert(elementPath, &arr[i])) {
+                    complete = false;
+                    break;
+                }
+                pending.emplace_back(std::move(elementPath), &arr[i]);
+            }
+        }
+    }
+
+    info.complete = complete;
+    info.build_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+}
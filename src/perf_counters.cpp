@@ -0,0 +1,114 @@
+#include "perf_counters.h"
+
+#ifdef __linux__
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+#ifdef __linux__
+int openCounter(PerfCounters::Event event) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;  // Allowed up to perf_event_paranoid 2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (event) {
+        case PerfCounters::Cycles:
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PerfCounters::Instructions:
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PerfCounters::BranchMisses:
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        case PerfCounters::CacheMisses:
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        case PerfCounters::TlbMisses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+    }
+    // Separate descriptors rather than a group, so one missing event does
+    // not take the others down with it
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+#endif
+
+} // namespace
+
+PerfCounters::PerfCounters() {
+    for (std::size_t i = 0; i < EventCount; ++i) {
+#ifdef __linux__
+        descriptors[i] = openCounter(static_cast<Event>(i));
+#else
+        descriptors[i] = -1;
+#endif
+    }
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+    for (int descriptor : descriptors) {
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+    }
+#endif
+}
+
+bool PerfCounters::available() const {
+    for (int descriptor : descriptors) {
+        if (descriptor >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PerfCounters::start() {
+#ifdef __linux__
+    for (int descriptor : descriptors) {
+        if (descriptor >= 0) {
+            ioctl(descriptor, PERF_EVENT_IOC_RESET, 0);
+            ioctl(descriptor, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+PerfCounters::Reading PerfCounters::stop() {
+    Reading reading;
+#ifdef __linux__
+    for (std::size_t i = 0; i < EventCount; ++i) {
+        if (descriptors[i] < 0) {
+            continue;
+        }
+        ioctl(descriptors[i], PERF_EVENT_IOC_DISABLE, 0);
+        std::uint64_t data[3];  // value, time enabled, time running
+        if (read(descriptors[i], data, sizeof(data)) != sizeof(data)) {
+            continue;
+        }
+        reading.available[i] = true;
+        reading.values[i] = data[2] == 0 ? 0
+                          : data[2] < data[1] ? static_cast<std::uint64_t>(static_cast<double>(data[0]) * data[1] / data[2])
+                                              : data[0];
+    }
+#endif
+    return reading;
+}
+
+const char *PerfCounters::eventName(Event event) {
+    static const char *names[EventCount] = {"cycles", "instructions", "branch misses", "cache misses", "dTLB misses"};
+    return names[event];
+}
@@ -0,0 +1,97 @@
+#include "pipelined_reader.h"
+#include "trace.h"
+#include <algorithm>
+
+PipelinedFileReader::PipelinedFileReader(const std::string &path, std::size_t blockSize, std::size_t blockCount)
+    : file(path, std::ios::binary), opened(file.is_open()), ring(std::max<std::size_t>(blockCount, 2)) {
+    if (!opened) {
+        return;
+    }
+    for (Block &block : ring) {
+        block.data.resize(std::max<std::size_t>(blockSize, 1));
+    }
+    reader = std::thread([this] { run(); });
+}
+
+PipelinedFileReader::~PipelinedFileReader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    if (reader.joinable()) {
+        reader.join();
+    }
+}
+
+void PipelinedFileReader::run() {
+    Tracer::setThreadName("file reader");
+    while (true) {
+        Block *block;
+        {
+            // Wait for a free slot: all others may be queued or in use
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return stopping || produced - consumed < ring.size(); });
+            if (stopping) {
+                return;
+            }
+            block = &ring[produced % ring.size()];
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            TraceSpan span("read block");
+            file.read(block->data.data(), block->data.size());
+        }
+        block->size = static_cast<std::size_t>(file.gcount());
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.read += elapsed;
+            if (block->size > 0) {
+                stats.bytes += block->size;
+                stats.blocks++;
+                produced++;
+            }
+            finished = !file;
+        }
+        changed.notify_all();
+        if (!file) {
+            return;
+        }
+    }
+}
+
+PipelinedFileReader::int_type PipelinedFileReader::underflow() {
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+    if (!opened) {
+        return traits_type::eof();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (holding) {
+        // Done with the current block, the reader may refill its slot
+        consumed++;
+        holding = false;
+        changed.notify_all();
+    }
+    auto start = std::chrono::steady_clock::now();
+    changed.wait(lock, [this] { return produced > consumed || finished; });
+    stats.wait += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    if (produced == consumed) {
+        return traits_type::eof();
+    }
+
+    holding = true;
+    Block &block = ring[consumed % ring.size()];
+    setg(block.data.data(), block.data.data(), block.data.data() + block.size);
+    return traits_type::to_int_type(*gptr());
+}
+
+PipelinedFileReader::Timings PipelinedFileReader::timings() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
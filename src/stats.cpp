@@ -0,0 +1,91 @@
+#include "stats.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <sys/resource.h>
+
+namespace {
+
+std::atomic<std::uint64_t> allocationCount{0};
+std::atomic<std::uint64_t> allocationBytes{0};
+
+#ifdef JSON_EVAL_TRACK_ALLOCATIONS
+std::atomic<std::uint64_t> categoryCount[AllocationCategoryCount];
+std::atomic<std::uint64_t> categoryBytes[AllocationCategoryCount];
+thread_local AllocationCategory currentCategory = AllocationCategory::Other;
+#endif
+
+void *countedAllocation(std::size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocationBytes.fetch_add(size, std::memory_order_relaxed);
+#ifdef JSON_EVAL_TRACK_ALLOCATIONS
+    std::size_t category = static_cast<std::size_t>(currentCategory);
+    categoryCount[category].fetch_add(1, std::memory_order_relaxed);
+    categoryBytes[category].fetch_add(size, std::memory_order_relaxed);
+#endif
+    // malloc(0) may return nullptr, operator new must not
+    if (void *memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+} // namespace
+
+// Replaces the global operator new for every binary linking this file. The
+// array and nothrow forms forward to this one in libstdc++.
+void *operator new(std::size_t size) {
+    return countedAllocation(size);
+}
+
+void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+AllocationCounters allocationCounters() {
+    return {allocationCount.load(std::memory_order_relaxed), allocationBytes.load(std::memory_order_relaxed)};
+}
+
+const char *allocationCategoryName(AllocationCategory category) {
+    static const char *names[AllocationCategoryCount] = {"other", "object node", "array growth", "string",
+                                                         "expression temporary"};
+    return names[static_cast<std::size_t>(category)];
+}
+
+CategoryAllocations allocationsByCategory() {
+    CategoryAllocations result;
+#ifdef JSON_EVAL_TRACK_ALLOCATIONS
+    for (std::size_t i = 0; i < AllocationCategoryCount; ++i) {
+        result.counters[i] = {categoryCount[i].load(std::memory_order_relaxed),
+                              categoryBytes[i].load(std::memory_order_relaxed)};
+    }
+#endif
+    return result;
+}
+
+#ifdef JSON_EVAL_TRACK_ALLOCATIONS
+AllocationScope::AllocationScope(AllocationCategory category) : previous(currentCategory) {
+    currentCategory = category;
+}
+
+AllocationScope::~AllocationScope() {
+    currentCategory = previous;
+}
+#endif
+
+std::uint64_t peakResidentBytes() {
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;  // Reported in KiB on Linux
+}
+
+double megabytesPerSecond(std::uint64_t bytes, std::chrono::microseconds time) {
+    // Bytes per microsecond is MB/s
+    return time.count() > 0 ? static_cast<double>(bytes) / time.count() : 0.0;
+}
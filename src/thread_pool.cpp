@@ -0,0 +1,109 @@
+#include "thread_pool.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+ThreadPool::ThreadPool(std::size_t workers) {
+    threads.reserve(workers);
+    for (std::size_t i = 0; i < workers; ++i) {
+        threads.emplace_back([this] { run(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    available.notify_all();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+ThreadPool &ThreadPool::shared() {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+void ThreadPool::run() {
+    Tracer::setThreadName("pool worker");
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            available.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void ThreadPool::parallel_for(std::size_t count, std::size_t chunk, const std::function<void(std::size_t, std::size_t)> &body) {
+    chunk = std::max<std::size_t>(chunk, 1);
+    std::size_t chunks = (count + chunk - 1) / chunk;
+    if (chunks <= 1 || threads.empty()) {
+        if (count > 0) {
+            body(0, count);
+        }
+        return;
+    }
+
+    // Shared with the helper tasks, which may only get to run after this
+    // call has returned and then find no chunks left
+    struct Job {
+        std::function<void(std::size_t, std::size_t)> body;
+        std::size_t count, chunk, chunks;
+        std::atomic<std::size_t> next{0};
+        std::atomic<std::size_t> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::exception_ptr error;
+    };
+    auto job = std::make_shared<Job>();
+    job->body = body;
+    job->count = count;
+    job->chunk = chunk;
+    job->chunks = chunks;
+
+    auto work = [job] {
+        std::size_t index;
+        while ((index = job->next.fetch_add(1)) < job->chunks) {
+            std::size_t begin = index * job->chunk;
+            try {
+                job->body(begin, std::min(begin + job->chunk, job->count));
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(job->mutex);
+                if (!job->error) {
+                    job->error = std::current_exception();
+                }
+            }
+            if (job->done.fetch_add(1) + 1 == job->chunks) {
+                std::lock_guard<std::mutex> lock(job->mutex);
+                job->finished.notify_all();
+            }
+        }
+    };
+
+    std::size_t helpers = std::min(threads.size(), chunks - 1);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::size_t i = 0; i < helpers; ++i) {
+            tasks.push_back(work);
+        }
+    }
+    available.notify_all();
+
+    work();
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->finished.wait(lock, [&job] { return job->done.load() == job->chunks; });
+    if (job->error) {
+        std::rethrow_exception(job->error);
+    }
+}
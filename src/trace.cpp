@@ -0,0 +1,134 @@
+#include "trace.h"
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+std::atomic<bool> Tracer::active{false};
+
+namespace {
+
+struct Span {
+    const char *name;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+};
+
+// Only its own thread writes to a buffer; the mutex is there for dump(),
+// so it is practically never contended
+struct ThreadBuffer {
+    std::mutex mutex;
+    std::size_t id = 0;
+    std::string name;
+    std::vector<Span> spans;
+    std::size_t next = 0;  // Total spans recorded, next % capacity is the slot to write
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+};
+
+Registry &registry() {
+    static Registry instance;
+    return instance;
+}
+
+thread_local const char *threadName = nullptr;
+thread_local std::shared_ptr<ThreadBuffer> threadBufferPointer;
+
+// Created on the first span of a thread, so threads that never record one
+// cost nothing. The registry keeps it alive after the thread exits.
+ThreadBuffer &threadBuffer() {
+    if (!threadBufferPointer) {
+        auto created = std::make_shared<ThreadBuffer>();
+        Registry &shared = registry();
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        created->id = shared.buffers.size() + 1;
+        created->name = threadName ? threadName : "thread " + std::to_string(created->id);
+        shared.buffers.push_back(created);
+        threadBufferPointer = std::move(created);
+    }
+    return *threadBufferPointer;
+}
+
+void writeEscaped(std::ostream &out, const std::string &text) {
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out << '\\';
+        }
+        out << c;
+    }
+}
+
+} // namespace
+
+void Tracer::enable(bool on) {
+    registry();  // Timestamps count from here
+    active.store(on, std::memory_order_relaxed);
+}
+
+void Tracer::setThreadName(const char *name) {
+    threadName = name;
+    if (threadBufferPointer) {
+        std::lock_guard<std::mutex> lock(threadBufferPointer->mutex);
+        threadBufferPointer->name = name;
+    }
+}
+
+void Tracer::record(const char *name, std::chrono::steady_clock::time_point start,
+                    std::chrono::steady_clock::time_point end) {
+    ThreadBuffer &buffer = threadBuffer();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    if (buffer.spans.size() < BufferCapacity) {
+        buffer.spans.push_back({name, start, end});
+    } else {
+        buffer.spans[buffer.next % BufferCapacity] = {name, start, end};
+    }
+    buffer.next++;
+}
+
+// {"traceEvents": [...]} with one complete ("X") event per span and a
+// thread_name metadata ("M") event per thread. Times are in microseconds.
+void Tracer::dump(std::ostream &out) {
+    Registry &shared = registry();
+    std::lock_guard<std::mutex> registryLock(shared.mutex);
+    auto micros = [&](std::chrono::steady_clock::time_point time) {
+        return std::chrono::duration<double, std::micro>(time - shared.epoch).count();
+    };
+
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\": [";
+    bool first = true;
+    for (const auto &buffer : shared.buffers) {
+        std::lock_guard<std::mutex> lock(buffer->mutex);
+        out << (first ? "\n" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+            << buffer->id << ", \"args\": {\"name\": \"";
+        writeEscaped(out, buffer->name);
+        out << "\"}}";
+        first = false;
+        for (const Span &span : buffer->spans) {
+            out << ",\n{\"name\": \"";
+            writeEscaped(out, span.name);
+            out << "\", \"cat\": \"json\", \"ph\": \"X\", \"ts\": " << micros(span.start)
+                << ", \"dur\": " << std::chrono::duration<double, std::micro>(span.end - span.start).count()
+                << ", \"pid\": 1, \"tid\": " << buffer->id << "}";
+        }
+    }
+    out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    out.flags(flags);
+    out.precision(precision);
+}
+
+void Tracer::clear() {
+    Registry &shared = registry();
+    std::lock_guard<std::mutex> registryLock(shared.mutex);
+    for (const auto &buffer : shared.buffers) {
+        std::lock_guard<std::mutex> lock(buffer->mutex);
+        buffer->spans.clear();
+        buffer->next = 0;
+    }
+}
@@ -1,6 +1,19 @@
 #include <gtest/gtest.h>
 #include "parser.h"
 #include "expression.h"
+#include "thread_pool.h"
+#include "document_store.h"
+#include "pipelined_reader.h"
+#include "decompressing_reader.h"
+#include "perf_counters.h"
+#include "trace.h"
+#include "minify.h"
+#ifdef JSON_EVAL_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include <atomic>
+#include <thread>
+#include <type_traits>
 
 // TEST(JsonParserTest, ParseInt) {
     // JsonParser parser;
@@ -44,6 +57,10 @@ TEST(JsonEvaluatorTest, EvaluateSimplePath) {
     ASSERT_EQ(result.type, JsonValue::INT);
     ASSERT_EQ(std::get<int>(result.value), 1);
 }
+// The evaluator keeps a reference to the document, so it cannot take a temporary
+static_assert(!std::is_constructible_v<JsonPathEvalator, JsonValue &&>);
+static_assert(std::is_constructible_v<JsonPathEvalator, const JsonValue &>);
+
 TEST(JsonEvaluatorTest, NestedPath) {
     JsonStorage storage("{\"a\": { \"b\": [ 1, 2, { \"c\": \"test\" }, [11, 12] ]}}");
     JsonValue result = storage.get("a.b[a.b[1]].c");
@@ -81,6 +98,986 @@ TEST(ExpressionEvaluatorTest, EvaluateComplexExpression) {
     ASSERT_EQ(std::get<int>(result.value), 7);
 }
 
+TEST(JsonEvaluatorTest, WildcardPath) {
+    JsonStorage storage("{\"items\": [{\"price\": 3}, {\"price\": 9}, {\"name\": \"x\"}, {\"price\": 5}]}");
+    PathMatch match = storage.select("items[*].price");
+    ASSERT_TRUE(match.multi_valued);
+    ASSERT_EQ(match.nodes.size(), 3);
+    ASSERT_EQ(std::get<int>(match.nodes[1]->value), 9);
+
+    JsonValue result = storage.get("items[*].price");
+    ASSERT_EQ(result.type, JsonValue::ARRAY);
+    ASSERT_EQ(result.size(), 3);
+}
+
+TEST(JsonEvaluatorTest, SlicePath) {
+    JsonStorage storage("{\"a\": [10, 11, 12, 13, 14, 15]}");
+    PathMatch match = storage.select("a[1:4]");
+    ASSERT_EQ(match.nodes.size(), 3);
+    ASSERT_EQ(std::get<int>(match.nodes[0]->value), 11);
+    ASSERT_EQ(std::get<int>(match.nodes[2]->value), 13);
+
+    match = storage.select("a[-2:]");
+    ASSERT_EQ(match.nodes.size(), 2);
+    ASSERT_EQ(std::get<int>(match.nodes[0]->value), 14);
+
+    match = storage.select("a[::2]");
+    ASSERT_EQ(match.nodes.size(), 3);
+    ASSERT_EQ(std::get<int>(match.nodes[2]->value), 14);
+}
+
+TEST(JsonEvaluatorTest, RecursiveDescentPath) {
+    JsonStorage storage("{\"id\": 1, \"a\": {\"id\": 2, \"b\": [{\"id\": 3}, {\"c\": {\"id\": 4}}]}}");
+    PathMatch match = storage.select("..id");
+    ASSERT_EQ(match.nodes.size(), 4);
+
+    match = storage.select("a..id");
+    ASSERT_EQ(match.nodes.size(), 3);
+    ASSERT_EQ(std::get<int>(match.nodes[0]->value), 2);
+}
+
+TEST(ExpressionEvaluatorTest, MultiValuedArguments) {
+    JsonStorage storage("{\"items\": [{\"price\": 3}, {\"price\": 9}, {\"price\": 5}], \"x\": {\"id\": 12}}");
+    ExpressionEvaluator evaluator(storage);
+    JsonValue result = evaluator.evaluate("max(items[*].price)");
+    ASSERT_EQ(std::get<int>(result.value), 9);
+
+    result = evaluator.evaluate("min(items[*].price, 4)");
+    ASSERT_EQ(std::get<int>(result.value), 3);
+
+    result = evaluator.evaluate("size(items[1:])");
+    ASSERT_EQ(std::get<int>(result.value), 2);
+
+    result = evaluator.evaluate("max(..id, ..price)");
+    ASSERT_EQ(std::get<int>(result.value), 12);
+}
+
+TEST(ExpressionEvaluatorTest, AggregateFunctions) {
+    JsonStorage storage("{\"a\": [4, -2, 9, 7], \"items\": [{\"price\": 3}, {\"price\": 9}, {\"price\": 6}]}");
+    ExpressionEvaluator evaluator(storage);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("sum(a)").value), 18);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("avg(a)").value), 4);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("count(a)").value), 4);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("min(a)").value), -2);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("max(a)").value), 9);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("sum(items[*].price)").value), 18);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("avg(items[*].price, 6)").value), 6);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("sum(1, 2, 3)").value), 6);
+    ASSERT_THROW(evaluator.evaluate("sum(items)"), std::runtime_error);
+}
+
+TEST(ExpressionEvaluatorTest, AggregateLargeAndMixedArrays) {
+    std::string json = "{\"a\": [";
+    long long expectedSum = 0;
+    for (int i = 0; i < 5000; ++i) {
+        int value = (i * 7919) % 10007 - 5000;
+        expectedSum += value;
+        json += (i ? ", " : "") + std::to_string(value);
+    }
+    json += "], \"mixed\": [5, \"str\", 1, [1, 2]]}";
+
+    JsonStorage storage(json);
+    ExpressionEvaluator evaluator(storage);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("sum(a)").value), expectedSum);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("min(a)").value), -5000);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("max(a)").value), 5006);
+
+    // Mixed arrays fall back to the generic type ordering
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("min(mixed)").value), 1);
+    ASSERT_EQ(evaluator.evaluate("max(mixed)").type, JsonValue::ARRAY);
+}
+
+TEST(AggregateTest, KernelMatchesScalarReduction) {
+    std::vector<int> values;
+    for (int i = 0; i < 1037; ++i) {
+        values.push_back((i % 2 ? 1 : -1) * (i * 104729 % 2147483));
+    }
+    for (std::size_t length : {0, 3, 16, 17, 1037}) {
+        IntAggregate result = aggregateInts(values.data(), length);
+        long long sum = 0;
+        for (std::size_t i = 0; i < length; ++i) {
+            sum += values[i];
+        }
+        ASSERT_EQ(result.count, length);
+        ASSERT_EQ(result.sum, sum);
+        if (length > 0) {
+            ASSERT_EQ(result.min, *std::min_element(values.begin(), values.begin() + length));
+            ASSERT_EQ(result.max, *std::max_element(values.begin(), values.begin() + length));
+        }
+    }
+}
+
+TEST(MinifyTest, StripsWhitespaceOutsideStrings) {
+    std::string body;
+    std::string expected;
+    for (int i = 0; i < 20; ++i) {
+        std::string key = "\"key " + std::to_string(i) + " with \\\" and \\\\ inside\"";
+        body += "{\n    " + key + " :\t[1, 2,\r\n 3]   } ";
+        expected += "{" + key + ":[1,2,3]}";
+    }
+    // Padding moves strings and escapes across the 32-byte chunks
+    for (std::size_t padding = 0; padding <= 33; ++padding) {
+        std::string text = std::string(padding, ' ') + body;
+        std::string out(text.size(), '\0');
+        out.resize(minifyJson(text, out.data()));
+        ASSERT_EQ(out, expected);
+    }
+}
+
+TEST(JsonParserTest, VariantAccessorsStillWork) {
+    JsonValue document = JsonParser().parse("{\"n\": 7, \"s\": \"a string longer than fourteen\", \"a\": [1, 2]}");
+    ASSERT_EQ(static_cast<const void *>(&document.value), static_cast<const void *>(&document));
+    ASSERT_TRUE(std::holds_alternative<JsonObject>(document.value));
+    ASSERT_EQ(document.value.index(), 2);
+    ASSERT_EQ(std::get<int>(document["n"].value), 7);
+    ASSERT_EQ(std::get<std::string>(document["s"].value), "a string longer than fourteen");
+    ASSERT_EQ(std::get<JsonArray>(document["a"].value).size(), 2);
+    ASSERT_THROW(std::get<int>(document["s"].value), std::bad_variant_access);
+
+    // Through a mutable value the containers can be changed in place
+    std::get<JsonObject>(document.value)["m"] = 8;
+    std::get<JsonArray>(document["a"].value).push_back(3);
+    ASSERT_EQ(std::get<int>(document["m"].value), 8);
+    ASSERT_EQ(document["a"].size(), 3);
+}
+
+TEST(JsonParserTest, PackedIntArrays) {
+    JsonStorage storage(std::string("{\"ints\": [3, -1, 4, 1, 5], \"mixed\": [1, \"x\", 2], \"empty\": []}"));
+    const JsonValue &ints = storage.root()["ints"];
+    ASSERT_NE(ints.packedInts(), nullptr);
+    ASSERT_EQ(storage.root()["mixed"].packedInts(), nullptr);
+    ASSERT_EQ(storage.root()["empty"].packedInts(), nullptr);
+
+    // Reads that do not need nodes keep the array packed
+    ASSERT_EQ(ints.size(), 5);
+    ExpressionEvaluator evaluator(storage);
+    ASSERT_EQ(evaluator.evaluate("sum(ints)").asInt(), 12);
+    ASSERT_EQ(evaluator.evaluate("min(ints)").asInt(), -1);
+    ASSERT_EQ(evaluator.evaluate("count(ints)").asInt(), 5);
+    ASSERT_EQ(evaluator.evaluate("size(ints)").asInt(), 5);
+    std::ostringstream out;
+    printJsonValue(ints, out);
+    ASSERT_EQ(out.str(), "[3, -1, 4, 1, 5]");
+    ASSERT_EQ(ints, JsonValue(JsonArray{3, -1, 4, 1, 5}));
+    ASSERT_FALSE(ints == JsonValue(JsonArray{3, -1, 4, 1, "5"}));
+
+    // Paths into the array see ordinary nodes
+    ASSERT_EQ(storage.get("ints[2]").asInt(), 4);
+    ASSERT_EQ(evaluator.evaluate("max(ints[*])").asInt(), 5);
+    ASSERT_EQ(evaluator.evaluate("count(ints[?(@ > 2)])").asInt(), 3);
+    ASSERT_EQ(storage.get("mixed[1]").asString(), "x");
+
+    // A null keeps the array unpacked, the ints could not tell it from 0
+    JsonValue withNull = JsonParser().parse("[null, 1]");
+    ASSERT_EQ(withNull.packedInts(), nullptr);
+    ASSERT_TRUE(withNull[0].isNull());
+    ASSERT_FALSE(withNull[1].isNull());
+    std::ostringstream nullOut;
+    printJsonValue(withNull, nullOut);
+    ASSERT_EQ(nullOut.str(), "[null, 1]");
+
+    // Patching turns it into a plain array
+    storage.apply_patch("[{\"op\": \"add\", \"path\": \"/ints/-\", \"value\": \"end\"}]");
+    ASSERT_EQ(storage.root()["ints"].packedInts(), nullptr);
+    ASSERT_EQ(storage.get("ints[5]").asString(), "end");
+    ASSERT_EQ(evaluator.evaluate("size(ints)").asInt(), 6);
+}
+
+TEST(JsonParserTest, PackedArrayLookupsStayPacked) {
+    constexpr int count = 100000;
+    std::string json = "{\"values\": [";
+    for (int i = 0; i < count; ++i) {
+        json += (i ? "," : "") + std::to_string(i);
+    }
+    JsonStorage storage(json + "]}");
+    ExpressionEvaluator evaluator(storage);
+
+    // Only the matched elements get a node, nothing is kept afterwards
+    CompiledExpression lookup = evaluator.compile("values[5]");
+    CompiledExpression slice = evaluator.compile("values[10:13]");
+    AllocationCounters before = evaluator.stats().allocations;
+    ASSERT_EQ(evaluator.evaluate(lookup).asInt(), 5);
+    ASSERT_EQ(evaluator.evaluate(slice), JsonValue(JsonArray{10, 11, 12}));
+    AllocationCounters made = evaluator.stats().allocations - before;
+    ASSERT_LT(made.bytes, 4096);
+    ASSERT_EQ(storage.get("values[99999]").asInt(), 99999);
+
+    // Aggregates over a wildcard read the ints, no node per element
+    before = evaluator.stats().allocations;
+    ASSERT_EQ(evaluator.evaluate("max(values[*])").asInt(), count - 1);
+    made = evaluator.stats().allocations - before;
+    ASSERT_LT(made.bytes, count * sizeof(JsonValue));
+    ASSERT_NE(storage.root()["values"].packedInts(), nullptr);
+    ASSERT_EQ(storage.root()["values"].packedInts()->size(), count);
+}
+
+TEST(JsonParserTest, DeduplicatedSubtrees) {
+    std::string json = "{\"areas\": ["
+                       "{\"id\": 1, \"meta\": {\"unit\": \"m\", \"scale\": [1, 2]}},"
+                       "{\"id\": 2, \"meta\": {\"unit\": \"m\", \"scale\": [1, 2]}},"
+                       "{\"id\": 1, \"meta\": {\"unit\": \"m\", \"scale\": [1, 2]}}]}";
+    JsonStorage plain(json);
+    JsonStorage storage(json, ParseOptions{true});
+    ASSERT_EQ(plain.stats().subtrees, 0);
+    ASSERT_DOUBLE_EQ(plain.stats().dedup_ratio(), 1.0);
+    // The root, areas and one of each area, meta and scale are stored
+    ASSERT_EQ(storage.stats().subtrees, 11);
+    ASSERT_EQ(storage.stats().distinct_subtrees, 6);
+    const JsonValue &areas = storage.root()["areas"];
+    ASSERT_EQ(areas[0]["meta"].block(), areas[1]["meta"].block());
+    ASSERT_EQ(areas[0].block(), areas[2].block());
+
+    // Queries cannot tell the difference
+    ASSERT_EQ(storage.root(), plain.root());
+    ExpressionEvaluator evaluator(storage);
+    ASSERT_EQ(evaluator.evaluate("sum(areas[*].id)").asInt(), 4);
+    ASSERT_EQ(evaluator.evaluate("count(..unit)").asInt(), 3);
+    ASSERT_EQ(evaluator.evaluate("sum(areas[1].meta.scale)").asInt(), 3);
+
+    // A patch copies the path to what it changes and nothing else
+    storage.apply_patch("[{\"op\": \"replace\", \"path\": \"/areas/0/meta/unit\", \"value\": \"cm\"}]");
+    ASSERT_EQ(storage.get("areas[0].meta.unit").asString(), "cm");
+    ASSERT_EQ(storage.get("areas[2].meta.unit").asString(), "m");
+    const JsonValue &patched = storage.root()["areas"];
+    ASSERT_EQ(patched[1]["meta"].block(), patched[2]["meta"].block());
+    ASSERT_FALSE(patched[0]["meta"].isShared());
+    ASSERT_EQ(patched[0]["meta"]["scale"].block(), patched[2]["meta"]["scale"].block());
+}
+
+TEST(JsonParserTest, ShapedObjects) {
+    std::string wide = "{";
+    for (std::size_t i = 0; i <= JsonParser::MaxShapeKeys; ++i) {
+        wide += (i ? ", \"k" : "\"k") + std::to_string(i) + "\": 0";
+    }
+    wide += "}";
+    JsonStorage storage("{\"r\": [{\"b\": 2, \"a\": 1}, {\"a\": 3, \"b\": 4}, {\"a\": 5, \"a\": 6}], \"wide\": " +
+                        wide + "}");
+    const JsonValue &records = storage.root()["r"];
+    ASSERT_NE(records[0].shaped(), nullptr);
+    ASSERT_EQ(records[0].shaped()->shape, records[1].shaped()->shape);
+    // Duplicate keys and very wide objects are stored as a JsonObject
+    ASSERT_EQ(records[2].shaped(), nullptr);
+    ASSERT_EQ(records[2]["a"].asInt(), 6);
+    ASSERT_EQ(storage.root()["wide"].shaped(), nullptr);
+    ASSERT_EQ(storage.root()["wide"].memberCount(), JsonParser::MaxShapeKeys + 1);
+
+    // Both forms read the same
+    ASSERT_EQ(records[0].memberCount(), 2);
+    ASSERT_TRUE(records[0].contains("b"));
+    ASSERT_EQ(records[0].find("c"), nullptr);
+    ASSERT_EQ(records[0].asObject().at("b").asInt(), 2);
+    ASSERT_EQ(records[0], JsonValue(JsonObject{{"a", 1}, {"b", 2}}));
+    std::ostringstream out;
+    printJsonValue(records[0], out);
+    ASSERT_EQ(out.str(), "{\"a\": 1, \"b\": 2}");
+
+    // An Object step remembers the slot of its key in the last shape
+    std::vector<Path> steps = JsonPathEvalator::compile("r[*].b");
+    PathMatch match = JsonPathEvalator(storage.root()).select(steps);
+    ASSERT_EQ(match.nodes.size(), 2);
+    ASSERT_EQ(match.nodes[1]->asInt(), 4);
+    ASSERT_EQ(steps[2].shape_cache.shape.load(), records[0].shaped()->shape.get());
+    ExpressionEvaluator evaluator(storage);
+    ASSERT_EQ(evaluator.evaluate("count(r[?(@.b > 2)])").asInt(), 1);
+
+    // Patching a shaped object turns it into a JsonObject
+    storage.apply_patch("[{\"op\": \"add\", \"path\": \"/r/1/c\", \"value\": 7}]");
+    ASSERT_EQ(storage.root()["r"][1].shaped(), nullptr);
+    ASSERT_EQ(storage.get("r[1].c").asInt(), 7);
+    ASSERT_EQ(storage.get("r[1].a").asInt(), 3);
+}
+
+TEST(JsonParserTest, IntKeyedObjects) {
+    JsonStorage storage("{\"names\": {\"205705994\": \"b\", \"205705993\": \"a\"},"
+                        " \"mixed\": {\"10\": 1, \"9\": 2, \"100\": 3}, \"other\": {\"1\": 1, \"x\": 2},"
+                        " \"padded\": {\"01\": 1}}");
+    const JsonValue &names = storage.root()["names"];
+    ASSERT_NE(names.intKeyed(), nullptr);
+    ASSERT_EQ(names.intKeyed()->keys, (std::vector<std::uint64_t>{205705993, 205705994}));
+    ASSERT_TRUE(names.intKeyed()->string_order.empty());
+    ASSERT_EQ(storage.root()["other"].intKeyed(), nullptr);
+    ASSERT_EQ(storage.root()["padded"].intKeyed(), nullptr);
+    ASSERT_EQ(numericKey("007"), std::nullopt);
+    ASSERT_EQ(numericKey("18446744073709551615"), std::nullopt);
+
+    ASSERT_EQ(storage.get("names[\"205705993\"]").asString(), "a");
+    ASSERT_EQ(storage.get("names[\"205705994\"]").asString(), "b");
+    ASSERT_EQ(names.find("205705995"), nullptr);
+    ASSERT_EQ(names.find("0205705993"), nullptr);
+    ASSERT_EQ(names, JsonValue(JsonObject{{"205705993", "a"}, {"205705994", "b"}}));
+
+    // Members still come in key string order
+    std::ostringstream out;
+    printJsonValue(storage.root()["mixed"], out);
+    ASSERT_EQ(out.str(), "{\"10\": 1, \"100\": 3, \"9\": 2}");
+    ASSERT_EQ(storage.get("mixed.*"), JsonValue(JsonArray{1, 3, 2}));
+    ASSERT_EQ(storage.root()["mixed"].asObject().begin()->first, "10");
+
+    storage.apply_patch("[{\"op\": \"add\", \"path\": \"/mixed/x\", \"value\": 4}]");
+    ASSERT_EQ(storage.root()["mixed"].intKeyed(), nullptr);
+    ASSERT_EQ(storage.get("mixed.x").asInt(), 4);
+    ASSERT_EQ(storage.get("mixed[\"100\"]").asInt(), 3);
+}
+
+TEST(JsonParserTest, CopiesShareContainers) {
+    std::string json = "{\"areaNames\": [";
+    for (int i = 0; i < 1000; ++i) {
+        json += (i ? ", \"" : "\"") + std::string("area number ") + std::to_string(i) + " of the map\"";
+    }
+    json += "], \"areas\": [{\"id\": 1, \"tags\": [\"a\"]}, {\"id\": 2, \"tags\": [\"b\", \"c\"]}]}";
+    JsonStorage storage(json);
+    const JsonValue &names = storage.root()["areaNames"];
+
+    JsonValue copy = names;
+    ASSERT_EQ(copy.block(), names.block());
+    ASSERT_TRUE(names.isShared());
+
+    // Changing one copy leaves the other alone
+    copy[0] = "renamed";
+    ASSERT_NE(copy.block(), names.block());
+    ASSERT_FALSE(names.isShared());
+    ASSERT_EQ(names[0].asString(), "area number 0 of the map");
+    ASSERT_EQ(copy[1].asString(), names[1].asString());
+
+    // Results of evaluate are the document's own blocks, not deep copies
+    ExpressionEvaluator evaluator(storage);
+    CompiledExpression whole = evaluator.compile("areaNames");
+    CompiledExpression second = evaluator.compile("areas[1]");
+    AllocationCounters before = allocationCounters();
+    const JsonValue result = evaluator.evaluate(whole);
+    const JsonValue area = evaluator.evaluate(second);
+    AllocationCounters made = allocationCounters() - before;
+    ASSERT_EQ(result.block(), names.block());
+    ASSERT_EQ(area.block(), storage.root()["areas"][1].block());
+    ASSERT_LT(made.count, 20);
+
+    // A result held across a patch keeps the old value
+    storage.apply_patch("[{\"op\": \"replace\", \"path\": \"/areas/1/id\", \"value\": 3}]");
+    ASSERT_EQ(area["id"].asInt(), 2);
+    ASSERT_EQ(storage.get("areas[1].id").asInt(), 3);
+    ASSERT_EQ(area["tags"].block(), storage.root()["areas"][1]["tags"].block());
+}
+
+TEST(JsonParserTest, SourceSpans) {
+    std::string json = "{\"areas\": [ {\"id\": 1,  \"name\": \"a\"},\n  {\"id\": 2, \"tags\": [true, null]} ], \"n\": 5}";
+    JsonStorage plain(json);
+    ASSERT_TRUE(plain.source_text(plain.root()).empty());
+    JsonStorage fromString(json, ParseOptions{false, true});
+    ASSERT_EQ(fromString.source_text(fromString.root()), json);
+
+    std::istringstream input(json);
+    JsonStorage storage(input, ParseOptions{false, true});
+    ASSERT_EQ(storage.source_text(storage.root()), json);
+    ExpressionEvaluator evaluator(storage);
+    JsonValue areas = evaluator.evaluate("areas");
+    ASSERT_EQ(storage.source_text(areas), "[ {\"id\": 1,  \"name\": \"a\"},\n  {\"id\": 2, \"tags\": [true, null]} ]");
+    ASSERT_EQ(storage.source_text(evaluator.evaluate("areas[1].tags")), "[true, null]");
+
+    // Arrays the query built are printed around the text of their elements
+    std::ostringstream out;
+    printJsonSource(evaluator.evaluate("areas[*]"), storage, out, true);
+    ASSERT_EQ(out.str(), "[{\"id\":1,\"name\":\"a\"}, {\"id\":2,\"tags\":[true,null]}]");
+
+    // Once patched the document is printed from the tree
+    storage.apply_patch("[{\"op\": \"replace\", \"path\": \"/n\", \"value\": 6}]");
+    ASSERT_TRUE(storage.source_text(storage.root()).empty());
+    std::ostringstream patched;
+    printJsonSource(storage.root()["areas"][1], storage, patched);
+    ASSERT_EQ(patched.str(), "{\"id\": 2, \"tags\": [1, null]}");
+}
+
+TEST(JsonEvaluatorTest, ColumnProjection) {
+    std::string json = "{\"records\": [";
+    int expectedMax = 0;
+    for (int i = 0; i < 200; ++i) {
+        json += i ? ", " : "";
+        if (i % 7 == 3) {
+            json += "{\"id\": " + std::to_string(i) + "}";
+        } else {
+            json += "{\"latency\": " + std::to_string(i * 3) + "}";
+            expectedMax = i * 3;
+        }
+    }
+    json += "], \"tags\": [{\"v\": 1}, {\"v\": \"x\"}]}";
+
+    JsonStorage storage(json);
+    const IntColumn *column = storage.column("records[*].latency");
+    ASSERT_NE(column, nullptr);
+    ASSERT_EQ(column->rows, 200);
+    ASSERT_EQ(column->valid_count, 171);
+    ASSERT_FALSE(column->is_valid(3));
+    ASSERT_EQ(column->aggregate().max, expectedMax);
+    ASSERT_EQ(storage.column("records[*].latency"), column);
+
+    // Fields that are not all ints are not projected, nor are other shapes
+    ASSERT_EQ(storage.column("tags[*].v"), nullptr);
+    ASSERT_EQ(storage.column("records..latency"), nullptr);
+    ASSERT_TRUE(JsonPathEvalator::is_projectable(JsonPathEvalator::compile("a[0].b[*].c")));
+    ASSERT_FALSE(JsonPathEvalator::is_projectable(JsonPathEvalator::compile("a[*].b[*]")));
+    ASSERT_FALSE(JsonPathEvalator::is_projectable(JsonPathEvalator::compile("a[*][a.n]")));
+    ASSERT_FALSE(JsonPathEvalator::is_projectable(JsonPathEvalator::compile("a.b")));
+
+    ExpressionEvaluator evaluator(storage);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("max(records[*].latency)").value), expectedMax);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("count(records[*].latency)").value), 171);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("min(records[*].latency, -1)").value), -1);
+    ASSERT_EQ(evaluator.evaluate("records[*].latency").size(), 171);
+    ASSERT_EQ(evaluator.evaluate("max(tags[*].v)").type, JsonValue::STRING);
+}
+
+TEST(ExpressionEvaluatorTest, CompiledExpressionReuse) {
+    JsonStorage storage("{\"a\": { \"b\": [ 1, 2, { \"c\": \"test\" }, [11, 12] ]}}");
+    ExpressionEvaluator evaluator(storage);
+    CompiledExpression expression = evaluator.compile("max(size(a.b[a.b[1]].c), 1)");
+    ASSERT_EQ(expression.root.kind, ExpressionNode::Call);
+    ASSERT_EQ(expression.root.function->name, "max");
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_EQ(std::get<int>(evaluator.evaluate(expression).value), 4);
+    }
+}
+
+TEST(ExpressionEvaluatorTest, ArityAndUnknownFunctionsRejectedAtCompile) {
+    JsonStorage storage("{\"a\": 1}");
+    ExpressionEvaluator evaluator(storage);
+    ASSERT_THROW(evaluator.compile("size(a, a)"), std::runtime_error);
+    ASSERT_THROW(evaluator.compile("max()"), std::runtime_error);
+    ASSERT_THROW(evaluator.compile("nope(a)"), std::runtime_error);
+}
+
+static JsonValue doubleFunction(const std::vector<EvalResult> &args) {
+    return JsonValue(2 * std::get<int>(args[0].single().value));
+}
+
+TEST(ExpressionEvaluatorTest, UserDefinedFunctions) {
+    JsonStorage storage("{\"a\": {\"b\": 21}}");
+    ExpressionEvaluator evaluator(storage);
+    evaluator.registerFunction("double", 1, 1, &doubleFunction);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("double(a.b)").value), 42);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("max(double(a.b), 50)").value), 50);
+    ASSERT_THROW(evaluator.compile("double(1, 2)"), std::runtime_error);
+    ASSERT_THROW(evaluator.registerFunction("max", 1, 1, &doubleFunction), std::runtime_error);
+}
+
+TEST(ExpressionEvaluatorTest, ConstantFolding) {
+    JsonStorage storage("{\"a\": {\"b\": 5, \"c\": [1, 2]}}");
+    ExpressionEvaluator evaluator(storage);
+
+    CompiledExpression folded = evaluator.compile("size(\"literal\")");
+    ASSERT_EQ(folded.root.kind, ExpressionNode::Literal);
+    ASSERT_EQ(std::get<int>(folded.root.literal.value), 7);
+
+    folded = evaluator.compile("max(3, 7, a.b)");
+    ASSERT_EQ(folded.root.kind, ExpressionNode::Call);
+    ASSERT_EQ(folded.root.args.size(), 2);
+    ASSERT_EQ(std::get<int>(folded.root.args[0].literal.value), 7);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate(folded).value), 7);
+
+    folded = evaluator.compile("min(max(1, 2), size(\"abc\"), a.b)");
+    ASSERT_EQ(folded.root.args.size(), 2);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate(folded).value), 2);
+
+    // Folding never leaves an array as the only argument, which would make
+    // max range over its elements: the array itself still competes
+    folded = evaluator.compile("max(3, 9, a.c)");
+    ASSERT_EQ(folded.root.args.size(), 2);
+    ASSERT_EQ(evaluator.evaluate(folded), JsonValue(JsonArray{1, 2}));
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("max(a.c)").value), 2);
+}
+
+TEST(ExpressionEvaluatorTest, StaticTypeErrors) {
+    JsonStorage storage("{\"a\": 1}");
+    ExpressionEvaluator evaluator(storage);
+    ASSERT_THROW(evaluator.compile("size(3)"), std::runtime_error);
+    ASSERT_THROW(evaluator.compile("size(size(a))"), std::runtime_error);
+    ASSERT_THROW(evaluator.compile("sum(a, \"x\")"), std::runtime_error);
+    ASSERT_NO_THROW(evaluator.compile("size(a)"));
+}
+
+TEST(JsonEvaluatorTest, FilterPredicates) {
+    JsonStorage storage("{\"limit\": 100, \"items\": ["
+                        "{\"name\": \"a\", \"size\": 50, \"tags\": [\"x\"]},"
+                        "{\"name\": \"b\", \"size\": 150, \"active\": 1},"
+                        "{\"name\": \"c]\", \"size\": 250, \"tags\": [\"x\", \"y\"]},"
+                        "{\"name\": \"d\"}]}");
+    ExpressionEvaluator evaluator(storage);
+
+    JsonValue result = evaluator.evaluate("items[?(@.size > 100)].name");
+    ASSERT_EQ(result.size(), 2);
+    ASSERT_EQ(std::get<std::string>(result[0].value), "b");
+    ASSERT_EQ(std::get<std::string>(result[1].value), "c]");
+
+    ASSERT_EQ(evaluator.evaluate("items[?(@.size >= 50 && @.size <= 150)].name").size(), 2);
+    ASSERT_EQ(evaluator.evaluate("items[?(@.size < limit || @.active)].name").size(), 2);
+    ASSERT_EQ(evaluator.evaluate("items[?(!(@.size))].name").size(), 1);
+    ASSERT_EQ(evaluator.evaluate("items[?(@.name == \"c]\")].size").size(), 1);
+    ASSERT_EQ(evaluator.evaluate("items[?(@.tags[*] == \"y\")].name").size(), 1);
+    ASSERT_EQ(evaluator.evaluate("items[?(size(@.tags) == 1)].name").size(), 1);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("max(items[?(@.name != \"b\")].size)").value), 250);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("count(items[?(@.size > 1000)])").value), 0);
+
+    ASSERT_THROW(evaluator.evaluate("items[?(@.size > )]"), std::runtime_error);
+    ASSERT_THROW(evaluator.evaluate("items[?@.size]"), std::runtime_error);
+}
+
+TEST(JsonEvaluatorTest, LargeFilterKeepsDocumentOrder) {
+    std::size_t length = JsonPathEvalator::ParallelFilterThreshold * 3;
+    std::string json = "{\"values\": [";
+    std::vector<int> expected;
+    for (std::size_t i = 0; i < length; ++i) {
+        int value = static_cast<int>(i * 7919 % 10007);
+        json += (i ? "," : "") + std::string("{\"v\": ") + std::to_string(value) + "}";
+        if (value < 3334) {
+            expected.push_back(value);
+        }
+    }
+    json += "]}";
+
+    JsonStorage storage(json);
+    PathMatch match = storage.select("values[?(@.v < 3334)].v");
+    ASSERT_TRUE(match.multi_valued);
+    std::vector<int> found;
+    for (const JsonValue *node : match.nodes) {
+        found.push_back(std::get<int>(node->value));
+    }
+    ASSERT_EQ(found, expected);
+}
+
+TEST(ThreadPoolTest, ParallelForCoversRangeOnce) {
+    ThreadPool pool(3);
+    std::vector<int> hits(10007);
+    pool.parallel_for(hits.size(), 64, [&hits](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            hits[i]++;
+        }
+    });
+    ASSERT_TRUE(std::all_of(hits.begin(), hits.end(), [](int hit) { return hit == 1; }));
+
+    ASSERT_THROW(pool.parallel_for(1000, 10, [](std::size_t begin, std::size_t) {
+        if (begin == 500) {
+            throw std::runtime_error("chunk failed");
+        }
+    }), std::runtime_error);
+}
+
+TEST(JsonStorageTest, PathIndex) {
+    JsonStorage storage("{\"a\": {\"b\": [1, 2, {\"c\": \"test\"}], \"x y\": 3}, \"n\": 4}");
+    const PathIndex &index = storage.build_index();
+    ASSERT_TRUE(index.stats().complete);
+    ASSERT_EQ(index.stats().entries, 8);
+    ASSERT_GT(index.stats().bytes, 0);
+
+    ASSERT_EQ(index.find("a.b[2].c"), &storage.root()["a"]["b"][2]["c"]);
+    ASSERT_EQ(index.find("a[\"x y\"]"), &storage.root()["a"]["x y"]);
+    ASSERT_EQ(std::get<std::string>(storage.get("a.b[2].c").value), "test");
+    ASSERT_EQ(storage.select("a.b[*]").nodes.size(), 3);
+    ASSERT_THROW(storage.get("a.missing"), std::runtime_error);
+
+    // Over budget only the shallow paths are kept, the rest still resolve
+    const PathIndex &small = storage.build_index(3 * sizeof(std::string));
+    ASSERT_FALSE(small.stats().complete);
+    ASSERT_LE(small.stats().bytes, small.stats().budget);
+    ASSERT_EQ(small.find("a.b[2].c"), nullptr);
+    ASSERT_EQ(std::get<int>(storage.get("a.b[1]").value), 2);
+}
+
+TEST(JsonStorageTest, LazyPathIndex) {
+    JsonStorage storage("{\"a\": {\"b\": [1, \"x\", 3]}, \"ints\": [1, 2, 3]}");
+    storage.enable_index();
+    ExpressionEvaluator evaluator(storage);
+    ASSERT_EQ(std::get<int>(evaluator.evaluate("sum(a.b[0], a.b[2])").value), 4);
+    ASSERT_EQ(storage.index()->stats().entries, 2);
+    ASSERT_EQ(storage.index()->find("a.b[2]"), &storage.root()["a"]["b"][2]);
+
+    // Multi-valued paths are not indexed
+    ASSERT_EQ(evaluator.evaluate("a.b[*]").size(), 3);
+    ASSERT_EQ(storage.index()->stats().entries, 2);
+
+    // Neither are elements of packed arrays, which have no node to point to
+    ASSERT_EQ(evaluator.evaluate("ints[1]").asInt(), 2);
+    ASSERT_EQ(storage.index()->stats().entries, 2);
+}
+
+TEST(JsonStorageTest, JsonPatch) {
+    JsonStorage storage("{\"a\": {\"b\": [1, 2, 3]}, \"c\": \"x\"}");
+    std::vector<JsonPointer> touched = storage.apply_patch(
+        "[{\"op\": \"add\", \"path\": \"/a/b/1\", \"value\": 9},"
+        " {\"op\": \"replace\", \"path\": \"/c\", \"value\": {\"d\": 4}},"
+        " {\"op\": \"move\", \"from\": \"/a/b/0\", \"path\": \"/a/first\"},"
+        " {\"op\": \"copy\", \"from\": \"/c/d\", \"path\": \"/a/b/-\"},"
+        " {\"op\": \"remove\", \"path\": \"/a/b/2\"},"
+        " {\"op\": \"test\", \"path\": \"/a/first\", \"value\": 1}]");
+    ASSERT_EQ(touched.size(), 6);
+    ASSERT_EQ(touched[0], (JsonPointer{"a", "b"}));
+    ASSERT_EQ(touched[1], (JsonPointer{"c"}));
+
+    JsonValue b = storage.get("a.b");
+    ASSERT_EQ(b.size(), 3);
+    ASSERT_EQ(std::get<int>(b[0].value), 9);
+    ASSERT_EQ(std::get<int>(b[1].value), 2);
+    ASSERT_EQ(std::get<int>(b[2].value), 4);
+    ASSERT_EQ(std::get<int>(storage.get("a.first").value), 1);
+    ASSERT_EQ(std::get<int>(storage.get("c.d").value), 4);
+
+    // A failing operation reverts the ones before it
+    ASSERT_THROW(storage.apply_patch("[{\"op\": \"add\", \"path\": \"/a/b/0\", \"value\": 7},"
+                                     " {\"op\": \"remove\", \"path\": \"/c\"},"
+                                     " {\"op\": \"test\", \"path\": \"/a/first\", \"value\": 2}]"),
+                 std::runtime_error);
+    ASSERT_EQ(storage.get("a.b").size(), 3);
+    ASSERT_EQ(std::get<int>(storage.get("c.d").value), 4);
+
+    ASSERT_THROW(storage.apply_patch("[{\"op\": \"remove\", \"path\": \"/a/b/3\"}]"), std::runtime_error);
+    ASSERT_THROW(storage.apply_patch("[{\"op\": \"move\", \"from\": \"/a\", \"path\": \"/a/b/0\"}]"), std::runtime_error);
+    ASSERT_THROW(storage.apply_patch("[{\"op\": \"frobnicate\", \"path\": \"/a\"}]"), std::runtime_error);
+    ASSERT_EQ(parseJsonPointer("/x~1y/~0"), (JsonPointer{"x/y", "~"}));
+}
+
+TEST(JsonStorageTest, MergePatchKeepsCachesConsistent) {
+    JsonStorage storage("{\"rows\": [{\"v\": 1}, {\"v\": 2}], \"meta\": {\"name\": \"a\", \"n\": 1}}");
+    storage.build_index();
+    ASSERT_EQ(storage.column("rows[*].v")->aggregate().sum, 3);
+
+    std::vector<JsonPointer> touched = storage.merge_patch("{\"meta\": {\"n\": 5}, \"rows\": [{\"v\": 10}]}");
+    ASSERT_EQ(touched.size(), 2);
+    ASSERT_EQ(std::get<int>(storage.get("meta.n").value), 5);
+    ASSERT_EQ(std::get<std::string>(storage.get("meta.name").value), "a");
+    ASSERT_EQ(storage.index()->find("rows[1]"), nullptr);
+    ASSERT_EQ(storage.column("rows[*].v")->aggregate().sum, 10);
+
+    // null removes a member, and is a no-op for one that is not there
+    touched = storage.merge_patch("{\"meta\": {\"n\": null, \"missing\": null}}");
+    ASSERT_EQ(touched, (std::vector<JsonPointer>{{"meta", "n"}}));
+    ASSERT_FALSE(storage.root()["meta"].contains("n"));
+    ASSERT_EQ(storage.get("meta.name").asString(), "a");
+    ASSERT_TRUE(JsonParser().parse("null").isNull());
+    ASSERT_FALSE(JsonParser().parse("0").isNull());
+    ASSERT_EQ(JsonParser().parse("null"), JsonValue(0));
+}
+
+TEST(ExpressionEvaluatorTest, SubscriptionsFollowPatches) {
+    JsonStorage storage("{\"prices\": [1, 2, 3], \"limits\": {\"max\": 10}, \"other\": 0}");
+    ExpressionEvaluator evaluator(storage);
+    std::vector<int> sums, limits;
+    evaluator.subscribe(evaluator.compile("sum(prices)"), [&sums](const JsonValue &result) {
+        sums.push_back(std::get<int>(result.value));
+    });
+    std::size_t limitId = evaluator.subscribe(evaluator.compile("limits.max"), [&limits](const JsonValue &result) {
+        limits.push_back(std::get<int>(result.value));
+    });
+    ASSERT_EQ(sums, std::vector<int>{6});
+    ASSERT_EQ(limits, std::vector<int>{10});
+
+    evaluator.applyPatch("[{\"op\": \"add\", \"path\": \"/prices/-\", \"value\": 4}]");
+    evaluator.applyPatch("[{\"op\": \"replace\", \"path\": \"/other\", \"value\": 1}]");
+    evaluator.applyMergePatch("{\"limits\": {\"max\": 20}}");
+    ASSERT_EQ(sums, (std::vector<int>{6, 10}));
+    ASSERT_EQ(limits, (std::vector<int>{10, 20}));
+
+    evaluator.unsubscribe(limitId);
+    evaluator.applyPatch("[{\"op\": \"replace\", \"path\": \"\", \"value\": {\"prices\": [], \"limits\": {\"max\": 1}}}]");
+    ASSERT_EQ(sums, (std::vector<int>{6, 10, 0}));
+    ASSERT_EQ(limits.size(), 2);
+
+    std::vector<JsonPointer> paths = ExpressionEvaluator::dependencies(
+        evaluator.compile("count(items[?(@.v > limits.max)].name, a.b[c].d)").root);
+    ASSERT_EQ(paths.size(), 4);
+    ASSERT_EQ(paths[0], (JsonPointer{"limits", "max"}));
+    ASSERT_EQ(paths[1], (JsonPointer{"items"}));
+    ASSERT_EQ(paths[2], (JsonPointer{"c"}));
+    ASSERT_EQ(paths[3], (JsonPointer{"a", "b"}));
+}
+
+TEST(ExpressionEvaluatorTest, SubscriptionsSeeStepsAfterTheFirstWildcard) {
+    JsonStorage storage("{\"a\": [[10, 11], [20, 21], [30, 31]], \"x\": {\"i\": 0}, \"y\": {\"j\": 0},"
+                        " \"items\": [{\"b\": [1, 5, 7]}, {\"b\": [2]}], \"t\": 4}");
+    ExpressionEvaluator evaluator(storage);
+    std::vector<int> cells, counts;
+    evaluator.subscribe(evaluator.compile("a[x.i][y.j]"), [&cells](const JsonValue &result) {
+        cells.push_back(result.asInt());
+    });
+    evaluator.subscribe(evaluator.compile("count(items[*].b[?(@ > t)])"), [&counts](const JsonValue &result) {
+        counts.push_back(result.asInt());
+    });
+    ASSERT_EQ(cells, std::vector<int>{10});
+    ASSERT_EQ(counts, std::vector<int>{2});
+
+    evaluator.applyPatch("[{\"op\": \"replace\", \"path\": \"/y/j\", \"value\": 1}]");
+    ASSERT_EQ(cells, (std::vector<int>{10, 11}));
+    evaluator.applyPatch("[{\"op\": \"replace\", \"path\": \"/t\", \"value\": 1}]");
+    ASSERT_EQ(counts, (std::vector<int>{2, 3}));
+}
+
+TEST(JsonStorageTest, PatchesLeaveSnapshotsUntouched) {
+    JsonStorage storage("{\"a\": [1, 2]}");
+    std::shared_ptr<const JsonValue> before = storage.snapshot();
+    storage.apply_patch("[{\"op\": \"add\", \"path\": \"/a/-\", \"value\": 3}]");
+    ASSERT_EQ((*before)["a"].size(), 2);
+    ASSERT_EQ(storage.get("a").size(), 3);
+    ASSERT_NE(storage.snapshot(), before);
+
+    // A document handed in is never written, even when nobody else holds it
+    auto handedIn = std::make_shared<const JsonValue>(JsonParser().parse("{\"a\": [1, 2]}"));
+    const JsonValue *original = handedIn.get();
+    JsonStorage wrapped(std::move(handedIn));
+    wrapped.apply_patch("[{\"op\": \"add\", \"path\": \"/a/-\", \"value\": 3}]");
+    ASSERT_NE(&wrapped.root(), original);
+    ASSERT_EQ(wrapped.get("a").size(), 3);
+    const JsonValue *copy = &wrapped.root();
+    wrapped.apply_patch("[{\"op\": \"add\", \"path\": \"/a/-\", \"value\": 4}]");
+    ASSERT_EQ(&wrapped.root(), copy);
+}
+
+TEST(JsonStorageTest, ReadingPatchOperationsLeaveTheDocumentAlone) {
+    JsonStorage storage("{\"rows\": [{\"v\": 1}, {\"v\": 2}], \"ints\": [4, 5], \"byId\": {\"7\": {\"v\": 3}}}");
+    const IntColumn *column = storage.column("rows[*].v");
+    const void *rows = storage.root()["rows"].block();
+    std::shared_ptr<const JsonValue> before = storage.snapshot();
+
+    // Tests alone neither copy the document nor drop its column
+    ASSERT_TRUE(storage.apply_patch("[{\"op\": \"test\", \"path\": \"/rows/1/v\", \"value\": 2},"
+                                    " {\"op\": \"test\", \"path\": \"/ints/1\", \"value\": 5},"
+                                    " {\"op\": \"test\", \"path\": \"/byId/7/v\", \"value\": 3}]").empty());
+    ASSERT_EQ(storage.snapshot(), before);
+    ASSERT_EQ(storage.column("rows[*].v"), column);
+    ASSERT_THROW(storage.apply_patch("[{\"op\": \"test\", \"path\": \"/ints/0\", \"value\": 5}]"),
+                 std::runtime_error);
+
+    // The source of a copy keeps its form and its block
+    before.reset();
+    storage.apply_patch("[{\"op\": \"copy\", \"from\": \"/rows/0\", \"path\": \"/first\"},"
+                        " {\"op\": \"copy\", \"from\": \"/ints/1\", \"path\": \"/second\"},"
+                        " {\"op\": \"test\", \"path\": \"/byId/7/v\", \"value\": 3}]");
+    ASSERT_EQ(storage.root()["rows"].block(), rows);
+    ASSERT_NE(storage.root()["rows"][0].shaped(), nullptr);
+    ASSERT_NE(storage.root()["ints"].packedInts(), nullptr);
+    ASSERT_NE(storage.root()["byId"].intKeyed(), nullptr);
+    ASSERT_EQ(storage.get("first.v").asInt(), 1);
+    ASSERT_EQ(storage.get("second").asInt(), 5);
+}
+
+// Version v of the document holds `Length` copies of v, so a reader that saw
+// a half-published document would get a sum that is not Length * version.
+TEST(DocumentStoreTest, ConcurrentReadersWithReloadingWriter) {
+    constexpr int Length = 64;
+    constexpr int Versions = 200;
+    auto documentFor = [](int version) {
+        std::string json = "{\"version\": " + std::to_string(version) + ", \"values\": [";
+        for (int i = 0; i < Length; ++i) {
+            json += (i ? "," : "") + std::to_string(version);
+        }
+        return json + "]}";
+    };
+
+    DocumentStore store(documentFor(1));
+    std::atomic<bool> done{false};
+    std::atomic<int> failures{0};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; ++r) {
+        readers.emplace_back([&] {
+            std::uint64_t lastSeen = 0;
+            do {
+                DocumentStore::Snapshot snapshot = store.snapshot();
+                JsonStorage storage(snapshot.document);
+                ExpressionEvaluator evaluator(storage);
+                int version = std::get<int>(evaluator.evaluate("version").value);
+                int sum = std::get<int>(evaluator.evaluate("sum(values)").value);
+                if (sum != Length * version || static_cast<std::uint64_t>(version) != snapshot.version ||
+                    snapshot.version < lastSeen) {
+                    failures++;
+                }
+                lastSeen = snapshot.version;
+            } while (!done.load());
+        });
+    }
+
+    for (int version = 2; version <= Versions; ++version) {
+        ASSERT_EQ(store.reload(documentFor(version)), static_cast<std::uint64_t>(version));
+    }
+    done = true;
+    for (std::thread &reader : readers) {
+        reader.join();
+    }
+    ASSERT_EQ(failures.load(), 0);
+    ASSERT_EQ(store.snapshot().version, static_cast<std::uint64_t>(Versions));
+    ASSERT_EQ(store.snapshot().document.use_count(), 2);
+}
+
+TEST(PipelinedReaderTest, ParsesAcrossBlockBoundaries) {
+    std::string json = "{\"items\": [";
+    for (int i = 0; i < 500; ++i) {
+        json += (i ? ", " : "") + std::string("{\"name\": \"item") + std::to_string(i) + "\", \"v\": " + std::to_string(i) + "}";
+    }
+    json += "]}";
+    std::string path = testing::TempDir() + "pipelined_reader_test.json";
+    std::ofstream(path, std::ios::binary) << json;
+
+    // Tiny blocks so every token is split somewhere and the ring wraps often
+    PipelinedFileReader reader(path, 7, 3);
+    ASSERT_TRUE(reader.is_open());
+    std::istream input(&reader);
+    JsonStorage storage(input);
+    ASSERT_EQ(std::get<int>(ExpressionEvaluator(storage).evaluate("sum(items[*].v)").value), 499 * 500 / 2);
+    ASSERT_EQ(std::get<std::string>(storage.get("items[499].name").value), "item499");
+
+    PipelinedFileReader::Timings timings = reader.timings();
+    ASSERT_EQ(timings.bytes, json.size());
+    ASSERT_EQ(timings.blocks, (json.size() + 6) / 7);
+
+    ASSERT_FALSE(PipelinedFileReader(path + ".missing").is_open());
+    std::remove(path.c_str());
+}
+
+TEST(DecompressionTest, PlainInputPassesThrough) {
+    std::istringstream input("{\"a\": [1, 2, 3]}");
+    DecompressingStreamBuf decoder(*input.rdbuf(), 4);
+    ASSERT_EQ(decoder.format(), DecompressingStreamBuf::Plain);
+    std::istream stream(&decoder);
+    ASSERT_EQ(JsonParser().parse(stream)["a"].size(), 3);
+    ASSERT_TRUE(DecompressingStreamBuf::supports(DecompressingStreamBuf::Plain));
+}
+
+#ifdef JSON_EVAL_HAVE_ZLIB
+static std::string gzipCompress(const std::string &data) {
+    z_stream stream{};
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    std::string compressed(deflateBound(&stream, data.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    stream.avail_in = data.size();
+    stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
+    stream.avail_out = compressed.size();
+    deflate(&stream, Z_FINISH);
+    compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+    return compressed;
+}
+
+TEST(DecompressionTest, GzipInputIsInflatedWhileParsing) {
+    std::string json = "{\"items\": [";
+    for (int i = 0; i < 2000; ++i) {
+        json += (i ? ", " : "") + std::to_string(i);
+    }
+    json += "]}";
+
+    std::istringstream compressed(gzipCompress(json));
+    JsonStorage storage(compressed);
+    ASSERT_EQ(std::get<int>(ExpressionEvaluator(storage).evaluate("sum(items)").value), 1999 * 2000 / 2);
+    ASSERT_EQ(storage.stats().input_bytes, json.size());
+
+    // Concatenated members are one stream, tiny buffers split everything
+    std::string half = json.substr(0, json.size() / 2);
+    std::istringstream members(gzipCompress(half) + gzipCompress(json.substr(half.size())));
+    DecompressingStreamBuf decoder(*members.rdbuf(), 16);
+    ASSERT_EQ(decoder.format(), DecompressingStreamBuf::Gzip);
+    std::istream stream(&decoder);
+    ASSERT_EQ(JsonParser().parse(stream)["items"].size(), 2000);
+
+    std::string data = gzipCompress(json);
+    std::istringstream truncated(data.substr(0, data.size() / 2));
+    ASSERT_THROW(JsonStorage storage(truncated), std::runtime_error);
+    data[data.size() / 2] ^= 0x55;
+    std::istringstream corrupt(data);
+    ASSERT_THROW(JsonStorage storage(corrupt), std::runtime_error);
+}
+#endif
+
+TEST(StatsTest, ParseAndEvaluationStats) {
+    std::string json = "{\"a\": [1, 2, {\"b\": \"x\"}], \"c\": true}";
+    std::istringstream input(json);
+    JsonStorage storage(input);
+    const ParseStats &parse = storage.stats();
+    ASSERT_EQ(parse.input_bytes, json.size());
+    ASSERT_EQ(parse.nodes[JsonValue::OBJECT], 2);
+    ASSERT_EQ(parse.nodes[JsonValue::ARRAY], 1);
+    ASSERT_EQ(parse.nodes[JsonValue::STRING], 1);
+    ASSERT_EQ(parse.nodes[JsonValue::INT], 3);
+    ASSERT_GT(parse.allocations.count, 0);
+    ASSERT_GE(parse.allocations.bytes, parse.allocations.count);
+
+    ExpressionEvaluator evaluator(storage);
+    evaluator.evaluate("size(a)");
+    evaluator.evaluate(evaluator.compile("c"));
+    ASSERT_EQ(evaluator.stats().evaluations, 2);
+    ASSERT_GT(evaluator.stats().allocations.count, 0);
+
+    AllocationCounters before = allocationCounters();
+    auto held = std::make_unique<std::array<char, 1000>>();
+    AllocationCounters made = allocationCounters() - before;
+    ASSERT_EQ(made.count, 1);
+    ASSERT_EQ(made.bytes, 1000);
+    ASSERT_GT(peakResidentBytes(), 0);
+}
+
+TEST(StatsTest, AllocationsByCategory) {
+    JsonStorage storage(std::string("{\"a\": [1, 2, 3, 4, 5], \"b\": \"a string longer than fifteen chars\"}"));
+    const CategoryAllocations &parse = storage.stats().allocations_by_category;
+    // The object and its value slots, the keys live in the shape
+    ASSERT_EQ(parse[AllocationCategory::ObjectNode].count, 2);
+    // Capacities 1, 2, 4 and 8 of packed ints
+    ASSERT_EQ(parse[AllocationCategory::ArrayGrowth].count, 4);
+    ASSERT_EQ(parse[AllocationCategory::ArrayGrowth].bytes, 15 * sizeof(int));
+    // The long string outgrows the small string buffer twice, keys never do
+    ASSERT_EQ(parse[AllocationCategory::String].count, 2);
+    ASSERT_EQ(parse[AllocationCategory::ExpressionTemporary].count, 0);
+
+    ExpressionEvaluator evaluator(storage);
+    evaluator.evaluate("sum(a[*])");
+    const CategoryAllocations &query = evaluator.stats().allocations_by_category;
+    ASSERT_GT(query[AllocationCategory::ExpressionTemporary].count, 0);
+    ASSERT_LE(query[AllocationCategory::ExpressionTemporary].count, 10);
+    ASSERT_EQ(query[AllocationCategory::ObjectNode].count, 0);
+    ASSERT_EQ(query[AllocationCategory::String].count, 0);
+}
+
+TEST(PerfCountersTest, ReadsOrDegradesGracefully) {
+    PerfCounters counters;
+    counters.start();
+    JsonStorage storage(std::string("{\"a\": [1, 2, 3]}"));
+    PerfCounters::Reading reading = counters.stop();
+    for (std::size_t i = 0; i < PerfCounters::EventCount; ++i) {
+        auto event = static_cast<PerfCounters::Event>(i);
+        ASSERT_NE(PerfCounters::eventName(event), nullptr);
+        if (!reading.has(event)) {
+            ASSERT_EQ(reading[event], 0);
+        }
+    }
+    if (reading.has(PerfCounters::Instructions)) {
+        ASSERT_GT(reading[PerfCounters::Instructions], 0);
+    }
+    ASSERT_EQ(counters.available(), reading.has(PerfCounters::Cycles) || reading.has(PerfCounters::Instructions) ||
+                                        reading.has(PerfCounters::BranchMisses) ||
+                                        reading.has(PerfCounters::CacheMisses) || reading.has(PerfCounters::TlbMisses));
+}
+
+TEST(TraceTest, SpansOfAllThreadsAreDumped) {
+    Tracer::clear();
+    { TraceSpan span("ignored while disabled"); }
+    Tracer::enable();
+    JsonStorage storage(std::string("{\"a\": [1, 2], \"b\": 3}"));
+    ExpressionEvaluator(storage).evaluate("size(a)");
+    std::thread worker([] {
+        Tracer::setThreadName("test worker");
+        TraceSpan span("worker span");
+    });
+    worker.join();
+    Tracer::enable(false);
+
+    std::ostringstream out;
+    Tracer::dump(out);
+    std::string trace = out.str();
+    ASSERT_EQ(trace.find("ignored while disabled"), std::string::npos);
+    for (const char *name : {"parse document", "parse subtree", "compile expression", "evaluate expression",
+                             "worker span", "\"test worker\"", "\"ph\": \"X\"", "\"ph\": \"M\""}) {
+        ASSERT_NE(trace.find(name), std::string::npos) << name;
+    }
+    // One subtree span per member of the root
+    std::size_t subtrees = 0;
+    for (std::size_t pos = trace.find("parse subtree"); pos != std::string::npos; pos = trace.find("parse subtree", pos + 1)) {
+        subtrees++;
+    }
+    ASSERT_EQ(subtrees, 2);
+    Tracer::clear();
+}
+
 // int main(int argc, char **argv) {
 //     ::testing::InitGoogleTest(&argc, argv);
 //     return RUN_ALL_TESTS();
@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include "parser.h"
+#include "expression.h"
+
+// Performance regression check. Runs each workload several times, takes the
+// median and the median absolute deviation (MAD) of the time per operation
+// and compares them with a checked-in baseline:
+//
+//   perf_regression --baseline tests/perf_baseline.json [--tolerance 50]
+//                   [--runs 7] [--filter parse] [--update]
+//
+// A workload regresses when its median exceeds the baseline median by more
+// than the tolerance (in percent) plus three baseline MADs. --update writes
+// the current numbers into the baseline instead of comparing; with --filter
+// the other workloads keep their recorded numbers. Without
+// --tolerance the JSON_EVAL_PERF_TOLERANCE environment variable is used, and
+// 50 without either. Timings are machine specific, so the baseline should
+// come from the machine that runs the check.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::string readFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+// Same records as json_bench uses
+std::string generateRecords(int count) {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> value(0, 1000);
+    std::string json = "{\"records\": [";
+    for (int i = 0; i < count; ++i) {
+        json += (i ? ", " : "") + std::string("{\"id\": ") + std::to_string(i) + ", \"v\": " +
+                std::to_string(value(rng)) + ", \"name\": \"record" + std::to_string(i) + "\"}";
+    }
+    return json + "]}";
+}
+
+struct Workload {
+    std::string name;
+    std::function<void()> run;  // One operation
+};
+
+struct Measurement {
+    long long median_ns = 0;
+    long long mad_ns = 0;
+};
+
+long long median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    std::size_t middle = values.size() / 2;
+    double result = values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+    return std::llround(result);
+}
+
+// Repeats the operation until a run takes at least 20 ms, then times `runs`
+// runs of that many operations. The calibration doubles as warm-up.
+Measurement measure(const Workload &workload, int runs) {
+    const auto minimumRun = std::chrono::milliseconds(20);
+    long long iterations = 1;
+    while (true) {
+        auto start = Clock::now();
+        for (long long i = 0; i < iterations; ++i) {
+            workload.run();
+        }
+        if (Clock::now() - start >= minimumRun) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    std::vector<double> perOperation;
+    for (int run = 0; run < runs; ++run) {
+        auto start = Clock::now();
+        for (long long i = 0; i < iterations; ++i) {
+            workload.run();
+        }
+        std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+        perOperation.push_back(elapsed.count() / iterations);
+    }
+    Measurement result;
+    result.median_ns = median(perOperation);
+    std::vector<double> deviations;
+    for (double value : perOperation) {
+        deviations.push_back(std::abs(value - result.median_ns));
+    }
+    result.mad_ns = median(deviations);
+    return result;
+}
+
+// Nanoseconds are written as strings, JSON numbers only hold 32-bit ints
+// here, which would cap a workload at about 2.1 s
+long long readNanoseconds(const JsonValue &value) {
+    if (value.type == JsonValue::INT) {
+        return value.asInt();
+    }
+    std::string text(value.asString());
+    std::size_t end = 0;
+    long long result = std::stoll(text, &end);
+    if (end != text.size()) {
+        throw std::runtime_error("Invalid time in baseline: " + text);
+    }
+    return result;
+}
+
+// {"workloads": {"<name>": {"median_ns": "..", "mad_ns": ".."}, ...}}
+std::map<std::string, Measurement> readBaseline(const std::string &path) {
+    std::map<std::string, Measurement> baseline;
+    JsonValue document = JsonParser().parse(readFile(path));
+    if (!document.contains("workloads")) {
+        throw std::runtime_error("Baseline " + path + " has no \"workloads\" object");
+    }
+    for (const auto &[name, entry] : document["workloads"].asObject()) {
+        baseline[name] = {readNanoseconds(entry["median_ns"]), readNanoseconds(entry["mad_ns"])};
+    }
+    return baseline;
+}
+
+void writeBaseline(const std::string &path, const std::map<std::string, Measurement> &measurements) {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not write " + path);
+    }
+    file << "{\n  \"workloads\": {\n";
+    for (auto it = measurements.begin(); it != measurements.end(); ++it) {
+        file << "    \"" << it->first << "\": {\"median_ns\": \"" << it->second.median_ns
+             << "\", \"mad_ns\": \"" << it->second.mad_ns << "\"}" << (std::next(it) == measurements.end() ? "" : ",")
+             << "\n";
+    }
+    file << "  }\n}\n";
+}
+
+std::string formatTime(double ns) {
+    char buffer[32];
+    if (ns >= 1e6) {
+        std::snprintf(buffer, sizeof(buffer), "%.2f ms", ns / 1e6);
+    } else if (ns >= 1e3) {
+        std::snprintf(buffer, sizeof(buffer), "%.2f us", ns / 1e3);
+    } else {
+        std::snprintf(buffer, sizeof(buffer), "%.0f ns", ns);
+    }
+    return buffer;
+}
+
+std::vector<Workload> workloads() {
+    static const std::string small = readFile(std::string(JSON_EVAL_DATA_DIR) + "/small.json");
+    static const std::string big = readFile(std::string(JSON_EVAL_DATA_DIR) + "/big.json");
+    static const std::string records = generateRecords(20000);
+
+    // Documents for the evaluation and serialization workloads
+    static JsonStorage smallStorage(small);
+    static JsonStorage bigStorage(big);
+    static JsonStorage recordStorage(records);
+    static ExpressionEvaluator smallEvaluator(smallStorage);
+    static ExpressionEvaluator bigEvaluator(bigStorage);
+    static ExpressionEvaluator recordEvaluator(recordStorage);
+    static const CompiledExpression size = smallEvaluator.compile("size(events)");
+    static const CompiledExpression wildcard = bigEvaluator.compile("max(events.*.id)");
+    static const CompiledExpression filter = recordEvaluator.compile("count(records[?(@.v > 500)])");
+
+    auto parse = [](const std::string &json) {
+        return [&json] { JsonParser().parse(json); };
+    };
+    auto evaluate = [](ExpressionEvaluator &evaluator, const CompiledExpression &expression) {
+        return [&evaluator, &expression] { evaluator.evaluate(expression); };
+    };
+    auto print = [](const JsonStorage &storage) {
+        return [&storage] {
+            std::ostringstream out;
+            printJsonValue(storage.root(), out);
+        };
+    };
+    return {
+        {"parse_small", parse(small)},
+        {"parse_big", parse(big)},
+        {"parse_records", parse(records)},
+        {"evaluate_size", evaluate(smallEvaluator, size)},
+        {"evaluate_wildcard", evaluate(bigEvaluator, wildcard)},
+        {"evaluate_filter", evaluate(recordEvaluator, filter)},
+        {"serialize_big", print(bigStorage)},
+        {"serialize_records", print(recordStorage)},
+    };
+}
+
+void usage(const char *program) {
+    std::cerr << "Usage: " << program << " --baseline <file> [--tolerance <percent>] [--runs <n>]"
+              << " [--filter <substring>] [--update]" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    std::string baselinePath;
+    std::string filter;
+    const char *tolerance = std::getenv("JSON_EVAL_PERF_TOLERANCE");
+    double tolerancePercent = tolerance ? std::atof(tolerance) : 50;
+    int runs = 7;
+    bool update = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string flag = argv[i];
+        if (flag == "--update") {
+            update = true;
+        } else if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        } else if (flag == "--baseline") {
+            baselinePath = argv[++i];
+        } else if (flag == "--tolerance") {
+            tolerancePercent = std::atof(argv[++i]);
+        } else if (flag == "--runs") {
+            runs = std::max(1, std::atoi(argv[++i]));
+        } else if (flag == "--filter") {
+            filter = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (baselinePath.empty()) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    try {
+        std::map<std::string, Measurement> baseline;
+        if (!update) {
+            baseline = readBaseline(baselinePath);
+        }
+        // An update only replaces the workloads it measures
+        std::map<std::string, Measurement> recorded;
+        if (update && std::ifstream(baselinePath).is_open()) {
+            recorded = readBaseline(baselinePath);
+        }
+
+        std::map<std::string, Measurement> measured;
+        std::vector<std::string> regressions;
+        std::printf("%-20s %12s %12s %9s %10s %10s  %s\n", "workload", "baseline", "current", "change",
+                    "base MAD", "MAD", "status");
+        for (const Workload &workload : workloads()) {
+            if (workload.name.find(filter) == std::string::npos) {
+                continue;
+            }
+            Measurement current = measure(workload, runs);
+            measured[workload.name] = current;
+            auto it = baseline.find(workload.name);
+            if (it == baseline.end()) {
+                std::printf("%-20s %12s %12s %9s %10s %10s  %s\n", workload.name.c_str(), "-",
+                            formatTime(current.median_ns).c_str(), "-", "-", formatTime(current.mad_ns).c_str(),
+                            update ? "recorded" : "not in baseline");
+                continue;
+            }
+
+            const Measurement &previous = it->second;
+            double change = 100.0 * (current.median_ns - previous.median_ns) / previous.median_ns;
+            double limit = previous.median_ns * (1 + tolerancePercent / 100) + 3.0 * previous.mad_ns;
+            // Much more spread than the baseline makes the median less trustworthy
+            bool noisy = current.mad_ns > 3 * std::max(previous.mad_ns, previous.median_ns / 100);
+            const char *status = "ok";
+            if (current.median_ns > limit) {
+                status = "REGRESSED";
+                char line[256];
+                std::snprintf(line, sizeof(line), "%s: median %s vs baseline %s (%+.1f%%, allowed %+.1f%%)%s",
+                              workload.name.c_str(), formatTime(current.median_ns).c_str(),
+                              formatTime(previous.median_ns).c_str(), change,
+                              100.0 * (limit - previous.median_ns) / previous.median_ns,
+                              noisy ? ", runs were noisy" : "");
+                regressions.push_back(line);
+            } else if (noisy) {
+                status = "ok (noisy)";
+            }
+            std::printf("%-20s %12s %12s %+8.1f%% %10s %10s  %s\n", workload.name.c_str(),
+                        formatTime(previous.median_ns).c_str(), formatTime(current.median_ns).c_str(), change,
+                        formatTime(previous.mad_ns).c_str(), formatTime(current.mad_ns).c_str(), status);
+        }
+
+        if (update) {
+            for (const auto &[name, measurement] : measured) {
+                recorded[name] = measurement;
+            }
+            writeBaseline(baselinePath, recorded);
+            std::cout << "Baseline written to " << baselinePath << std::endl;
+            return 0;
+        }
+        if (!regressions.empty()) {
+            std::cout << "\n" << regressions.size() << " workload(s) regressed by more than " << tolerancePercent
+                      << "%:" << std::endl;
+            for (const std::string &line : regressions) {
+                std::cout << "  " << line << std::endl;
+            }
+            return 1;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 2;
+    }
+    return 0;
+}